@@ -9,15 +9,95 @@
 // at least for the getaddrinfo(...) function.
 #define _WIN32_WINNT 0x501
 
-#define PORT        "6666"
-#define BUFFER_SIZE 512
+#define PORT               "6666"
+#define BUFFER_SIZE        512
+#define WORKER_BUFFER_SIZE 16384
+#define WORKER_STACK_SIZE  65536
+#define STREAM_WINDOW      16
+#define MAX_DEPTHS         16
+#define PENDING_SLOT_BITS  16
+#define BENCH_REQUESTS     20000
+#define BENCH_BYTES        (1 << 28)
+#define BENCH_MEMORY       (1 << 28)
+#define BENCH_SAMPLES      1000
+#define BENCH_REPETITIONS  3
+#define ACCEPT_BATCH       64
+#define ACCEPT_TIMEOUT     100000
+#define ADMISSION_REPORT   5.0
+#define RATE_LIMIT_BITS    12
+#define RATE_LIMIT_BUCKETS (1 << RATE_LIMIT_BITS)
+#define RATE_LIMIT_PROBES  8
+#define CAPTURE_MAGIC      "WS2C"
+#define CAPTURE_VERSION    1
+#define CAPTURE_PAYLOAD    256
+#define CAPTURE_BATCH      65536
+#define CAPTURE_INTERVAL   0.1
+#define REPLAY_MAX_LENGTH  (1 << 26)
+#define CAPTURE_OPEN       0
+#define CAPTURE_INBOUND    1
+#define CAPTURE_OUTBOUND   2
+#define CAPTURE_CLOSE      3
+#define REPLAY_SPIN        0.002
+#define REPLAY_TIMEOUT     5.0
 
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mstcpip.h>
+#include <mmsystem.h>
+
+// Socket options and controls that are missing from older MinGW headers. The
+// values are taken from the Windows SDK headers where these are defined.
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN 15
+#endif
+#ifndef SIO_LOOPBACK_FAST_PATH
+#define SIO_LOOPBACK_FAST_PATH _WSAIOW(IOC_VENDOR, 16)
+#endif
+#ifndef SIO_TCP_SET_ACK_FREQUENCY
+#define SIO_TCP_SET_ACK_FREQUENCY _WSAIOW(IOC_VENDOR, 23)
+#endif
+#ifndef SOMAXCONN_HINT
+#define SOMAXCONN_HINT(b) (-(b))
+#endif
+
+// A named set of socket options to be applied to each created socket. All the
+// zero values are left untouched, so the system defaults are used for those.
+struct SocketProfile {
+  const char* name;
+  int  noDelay;           // TCP_NODELAY: Disable the Nagle algorithm.
+  int  ackFrequency;      // SIO_TCP_SET_ACK_FREQUENCY: Segments per ACK (1 = quick ACK).
+  int  loopbackFastPath;  // SIO_LOOPBACK_FAST_PATH: Bypass the TCP stack on loopback.
+  int  fastOpen;          // TCP_FASTOPEN: Allow data in the SYN (listen sockets only).
+  int  sendBufferSize;    // SO_SNDBUF: The size of the send buffer in bytes.
+  int  receiveBufferSize; // SO_RCVBUF: The size of the receive buffer in bytes.
+  int  backlog;           // The size of the pending connection queue for listen.
+  bool pinThreads;        // Pin each worker and client thread to a core in a round-robin manner.
+};
+
+const SocketProfile gProfiles[] = {
+  { "default",    0, 0, 0, 0, 0,       0,       SOMAXCONN,            false },
+  { "latency",    1, 1, 1, 1, 0,       0,       SOMAXCONN,            true  },
+  { "throughput", 0, 0, 0, 0, 1 << 22, 1 << 22, SOMAXCONN_HINT(4096), true  }
+};
+
+// The header in front of each message. The response to a request carries the
+// id of the request, so that many requests can be in flight on a connection
+// and the server is free to respond to them in any order. The fields are sent
+// in network byte order and the header is followed by the payload.
+struct FrameHeader {
+  u_long id;     // The id of the request chosen by the client.
+  u_long length; // The length of the payload in bytes.
+};
 
 WSADATA  gWsaData;
 char     gBuffer[BUFFER_SIZE];
+volatile bool gVerbose = true;
 
 // Initialize the support for Winsocks by initing the use of WS2_32.dll file.
 // This function will initialize the WSADATA structure to contain information
@@ -94,7 +174,9 @@ int resolveAddress(const char* host, const addrinfo& hints, addrinfo** info) {
   auto result = getaddrinfo(host, PORT, &hints, &*info);
   switch (result) {
   case 0:
-    printf("getaddrinfo succeeded.\n");
+    if (gVerbose) {
+      printf("getaddrinfo succeeded.\n");
+    }
     break;
   case WSATRY_AGAIN:
     printf("getaddrinfo failed: A temporary failure in name resolution occured.\n");
@@ -142,7 +224,9 @@ int resolveAddress(const char* host, const addrinfo& hints, addrinfo** info) {
 SOCKET createSocket(const addrinfo* addressInfo) {
   auto result = socket(addressInfo->ai_family, addressInfo->ai_socktype, addressInfo->ai_protocol);
   if (result != INVALID_SOCKET) {
-    printf("socket succeeded.\n");
+    if (gVerbose) {
+      printf("socket succeeded.\n");
+    }
   } else {
     auto errorCode = WSAGetLastError();
     switch (errorCode) {
@@ -202,7 +286,9 @@ SOCKET createSocket(const addrinfo* addressInfo) {
 int closeSocket(SOCKET socket) {
   auto result = closesocket(socket);
   if (result == 0) {
-    printf("closesocket succeeded.\n");
+    if (gVerbose) {
+      printf("closesocket succeeded.\n");
+    }
   } else {
     auto errorCode = WSAGetLastError();
     switch (errorCode) {
@@ -242,7 +328,9 @@ int closeSocket(SOCKET socket) {
 int bindSocket(SOCKET socket, addrinfo** addressInfo) {
   auto result = bind(socket, (*addressInfo)->ai_addr, (int)(*addressInfo)->ai_addrlen);
   if (result == 0) {
-    printf("bind succeeded.\n");
+    if (gVerbose) {
+      printf("bind succeeded.\n");
+    }
   } else {
     auto errorCode = WSAGetLastError();
     switch (errorCode) {
@@ -301,7 +389,9 @@ int connectSocket(SOCKET socket, addrinfo** addressInfo) {
   while (result != 0 && address != NULL) {
     result = connect(socket, address->ai_addr, (int)address->ai_addrlen);
     if (result == 0) {
-      printf("connect succeeded.\n");
+      if (gVerbose) {
+        printf("connect succeeded.\n");
+      }
     } else {
       auto errorCode = WSAGetLastError();
       switch (errorCode) {
@@ -385,7 +475,9 @@ int connectSocket(SOCKET socket, addrinfo** addressInfo) {
 int listenSocket(SOCKET socket, int maxBacklogSize) {
   auto result = listen(socket, maxBacklogSize);
   if (result == 0) {
-    printf("listen succeeded.\n");
+    if (gVerbose) {
+      printf("listen succeeded.\n");
+    }
   } else {
     auto errorCode = WSAGetLastError();
     switch (errorCode) {
@@ -431,19 +523,29 @@ int listenSocket(SOCKET socket, int maxBacklogSize) {
 // used by allowing connections from multiple clients. For real high-performance
 // servers, multiple threads should be used to handle multiple client connections.
 //
-// NOTE: This function blocks until a new client connection is received.
+// NOTE: This function blocks until a new client connection is received unless
+//       the server socket is marked as nonblocking.
 //
 // One example from the MS documentation for handling multiple clients:
 // Create a loop that checks for connection requests using the listen function.
 // If a connection request occurs, the application calls accept and passes it to
 // a another thread to handle the actual request.
 //
+// The condition function is called with the address of the client before the
+// client socket is created, so the client can be rejected without allocating
+// any resources for it. The rejected and the would-block errors are expected
+// when draining the pending connections, so those are not reported here.
+//
 // @param socket The server socket used to accept the client.
+// @param condition The condition function used to admit or reject the client.
+// @param conditionData The data passed to the condition function.
 // @returns A descriptor for the new socket.
-SOCKET acceptClient(SOCKET socket) {
-  SOCKET clientSocket = accept(socket, NULL, NULL);
+SOCKET acceptClient(SOCKET socket, LPCONDITIONPROC condition, DWORD_PTR conditionData) {
+  SOCKET clientSocket = WSAAccept(socket, NULL, NULL, condition, conditionData);
   if (clientSocket != INVALID_SOCKET) {
-    printf("accept succeeded.\n");
+    if (gVerbose) {
+      printf("accept succeeded.\n");
+    }
   } else {
     auto errorCode = WSAGetLastError();
     switch (errorCode) {
@@ -481,7 +583,7 @@ SOCKET acceptClient(SOCKET socket) {
         printf("accept failed: The referenced socket is not a type that supports connection-oriented service.\n");
         break;
       case WSAEWOULDBLOCK:
-        printf("accept failed: The socket is marked as nonblocking and no connections are present to be accepted.\n");
+      case WSAECONNREFUSED:
         break;
       default:
         printf("accept failed: An unknown error code %d occured.\n", errorCode);
@@ -507,7 +609,9 @@ SOCKET acceptClient(SOCKET socket) {
 int shutdownSocket(SOCKET socket, int shutdownType) {
   auto result = shutdown(socket, shutdownType);
   if (result == 0) {
-    printf("shutdown succeeded.\n");
+    if (gVerbose) {
+      printf("shutdown succeeded.\n");
+    }
   } else {
     auto errorCode = WSAGetLastError();
     switch (errorCode) {
@@ -543,20 +647,49 @@ int shutdownSocket(SOCKET socket, int shutdownType) {
   return result;
 }
 
-// Receive data from the target socket. This blocking function will wait until
-// some data is received from the target socket. Note that data may be send in
-// a patch, where a single incoming data may be split into network junks.
+// Write a frame header with the given values into the start of the buffer.
+//
+// @param buffer The buffer where to write the header.
+// @param id The id of the request.
+// @param length The length of the payload.
+void writeFrameHeader(char* buffer, u_long id, u_long length) {
+  FrameHeader header;
+  header.id = htonl(id);
+  header.length = htonl(length);
+  memcpy(buffer, &header, sizeof(header));
+}
+
+// Read a frame header from the start of the buffer.
+//
+// @param buffer The buffer holding the header.
+// @returns The header with the fields converted into host byte order.
+FrameHeader readFrameHeader(const char* buffer) {
+  FrameHeader header;
+  memcpy(&header, buffer, sizeof(header));
+  header.id = ntohl(header.id);
+  header.length = ntohl(header.length);
+  return header;
+}
+
+// Get the size of a whole frame including its header.
+//
+// @param buffer The buffer holding the header of the frame.
+// @returns The size of the frame in bytes.
+long long getFrameSize(const char* buffer) {
+  return (long long)sizeof(FrameHeader) + readFrameHeader(buffer).length;
+}
+
+// Receive data from the target socket into the given buffer. This blocking
+// function will wait until some data is received from the target socket. Only
+// errors are reported, so this function can be used in tight worker loops.
 //
 // @param socket A valid client socket.
+// @param buffer The buffer where to store the received data.
+// @param length The length of the buffer.
 // @returns 0 on a connection close, SOCKET_ERROR on an error and data length otherwise.
-int receive(SOCKET socket) {
-  auto result = recv(socket, gBuffer, BUFFER_SIZE, 0);
-  if (result == 0) {
-    printf("recv interrupted: The connection was closed by the remote end point.\n");
-  } else if (result != SOCKET_ERROR) {
-    gBuffer[BUFFER_SIZE-1] = '\0';
-    printf("recv succeeded: %s\n", gBuffer);
-  } else {
+int receive(SOCKET socket, char* buffer, int length) {
+  auto result = recv(socket, buffer, length, 0);
+  if (result == SOCKET_ERROR) {
     auto errorCode = WSAGetLastError();
     switch (errorCode) {
       case WSANOTINITIALISED:
@@ -615,18 +748,63 @@ int receive(SOCKET socket) {
   return result;
 }
 
-// Send the provided data message to the target socket. This function will send
-// the given message, which may or may not be split into junks depending on the
-// network configuration. This function blocks until the full message is sent.
+// Receive exactly the given amount of data from the target socket. This will
+// block until the whole buffer is filled or the connection is closed or fails.
+//
+// @param socket A valid client socket.
+// @param buffer The buffer where to store the received data.
+// @param length The amount of data to receive.
+// @returns 0 on a connection close, SOCKET_ERROR on an error and data length otherwise.
+int receiveAll(SOCKET socket, char* buffer, int length) {
+  auto received = 0;
+  while (received < length) {
+    auto result = receive(socket, buffer + received, length - received);
+    if (result <= 0) {
+      return result;
+    }
+    received += result;
+  }
+  return received;
+}
+
+// Receive a message from the target socket. This blocking function will wait
+// until a whole message frame is received from the target socket. Note that a
+// payload longer than the global buffer is truncated.
+//
+// @param socket A valid client socket.
+// @returns 0 on a connection close, SOCKET_ERROR on an error and data length otherwise.
+int receive(SOCKET socket) {
+  char header[sizeof(FrameHeader)];
+  auto result = receiveAll(socket, header, sizeof(header));
+  if (result > 0) {
+    auto length = std::min(readFrameHeader(header).length, (u_long)BUFFER_SIZE - 1);
+    result = length > 0 ? receiveAll(socket, gBuffer, (int)length) : 0;
+  }
+  if (result == 0) {
+    printf("recv interrupted: The connection was closed by the remote end point.\n");
+  } else if (result != SOCKET_ERROR) {
+    gBuffer[result] = '\0';
+    printf("recv succeeded: %s\n", gBuffer);
+  }
+  return result;
+}
+
+// Send the provided data to the target socket. This function will send all of
+// the given data, which may or may not be split into junks depending on the
+// network configuration. Only errors are reported by this function.
 //
 // @param socket A valid client socket.
 // @param data The data to be sent.
+// @param length The length of the data.
 // @returns The amount of data that was send and SOCKET_ERROR on an error.
-int send(SOCKET socket, const char* data) {
-  auto result = send(socket, data, (int)strlen(data), 0);
-  if (result != SOCKET_ERROR) {
-    printf("send succeeded.\n");
-  } else {
+int sendAll(SOCKET socket, const char* data, int length) {
+  auto sent = 0;
+  while (sent < length) {
+    auto result = send(socket, data + sent, length - sent, 0);
+    if (result != SOCKET_ERROR) {
+      sent += result;
+      continue;
+    }
     auto errorCode = WSAGetLastError();
     switch (errorCode) {
       case WSANOTINITIALISED:
@@ -690,75 +868,2375 @@ int send(SOCKET socket, const char* data) {
         printf("send failed: An unknown error code %d occured.\n", errorCode);
         break;
     }
+    return SOCKET_ERROR;
   }
-  return result;
+  return sent;
 }
 
-void startTcpServer() {
-  // create an address descriptor for a TCP server socket.
-  addrinfo hints;
-  ZeroMemory(&hints, sizeof(hints));
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
-  hints.ai_flags = AI_PASSIVE;
+// Send the provided data message to the target socket. This function will send
+// the given message, which may or may not be split into junks depending on the
+// network configuration. This function blocks until the full message is sent.
+// The message is sent as a single frame with a request id of zero.
+//
+// @param socket A valid client socket.
+// @param data The data to be sent.
+// @returns The amount of data that was send and SOCKET_ERROR on an error.
+int send(SOCKET socket, const char* data) {
+  auto length = strlen(data);
+  std::vector<char> frame(sizeof(FrameHeader) + length);
+  writeFrameHeader(frame.data(), 0, (u_long)length);
+  memcpy(frame.data() + sizeof(FrameHeader), data, length);
+  auto result = sendAll(socket, frame.data(), (int)frame.size());
+  if (result != SOCKET_ERROR) {
+    printf("send succeeded.\n");
+  }
+  return result;
+}
 
-  // resolve address details and open a new socket.
-  addrinfo* information = NULL;
-  if (resolveAddress(NULL, hints, &information) == 0) {
-    auto socket = createSocket(information);
-    if (socket != INVALID_SOCKET) {
-      if (bindSocket(socket, &information) == 0) {
-        if (listen(socket, SOMAXCONN) == 0) {
-          printf("waiting for a client to connect...\n");
-          auto clientSocket = acceptClient(socket);
-          if (clientSocket != INVALID_SOCKET) {
-            receive(clientSocket);
-            send(clientSocket, "A message from the server!");
-            shutdownSocket(clientSocket, SD_BOTH);
-            closeSocket(clientSocket);
-          }
-        }
-      }
-      closeSocket(socket);
+// Find the socket tuning profile with the given name. The name length is given
+// separately, so that names can be looked up from a comma separated list.
+//
+// @param name The name of the profile.
+// @param length The length of the name.
+// @returns A pointer to the profile or NULL if there's no such profile.
+const SocketProfile* findProfile(const char* name, size_t length) {
+  for (const auto& profile : gProfiles) {
+    if (strlen(profile.name) == length && strncmp(profile.name, name, length) == 0) {
+      return &profile;
     }
   }
-  freeaddrinfo(information);
+  return NULL;
 }
 
-void startTcpClient(const char* host) {
-  // create an address descriptor for a TCP client socket.
-  addrinfo hints;
-  ZeroMemory(&hints, sizeof(hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
+// Set an integer socket option and read it back to verify the value that the
+// system actually applied. Note that the system may silently adjust the value
+// e.g. when the requested buffer size is not within the allowed limits.
+//
+// @param socket The target socket.
+// @param level The level at which the option is defined e.g. SOL_SOCKET.
+// @param option The option to be set.
+// @param optionName The name of the option used in the report.
+// @param value The requested value of the option.
+// @returns 0 on a success and SOCKET_ERROR on an error.
+int setSocketOption(SOCKET socket, int level, int option, const char* optionName, int value) {
+  auto result = setsockopt(socket, level, option, (const char*)&value, sizeof(value));
+  if (result == SOCKET_ERROR) {
+    auto errorCode = WSAGetLastError();
+    switch (errorCode) {
+      case WSANOTINITIALISED:
+        printf("setsockopt %s failed: A successful WSAStartup call must occur before using this function.\n", optionName);
+        break;
+      case WSAENETDOWN:
+        printf("setsockopt %s failed: The network subsystem has failed.\n", optionName);
+        break;
+      case WSAEFAULT:
+        printf("setsockopt %s failed: The option value is not in a valid part of the process address space.\n", optionName);
+        break;
+      case WSAEINPROGRESS:
+        printf("setsockopt %s failed: A blocking socket call or callback is in progress.\n", optionName);
+        break;
+      case WSAEINVAL:
+        printf("setsockopt %s failed: The level is not valid or the option value is invalid.\n", optionName);
+        break;
+      case WSAENETRESET:
+        printf("setsockopt %s failed: The connection has timed out when SO_KEEPALIVE is set.\n", optionName);
+        break;
+      case WSAENOPROTOOPT:
+        printf("setsockopt %s failed: The option is unknown or unsupported by the provider or socket.\n", optionName);
+        break;
+      case WSAENOTCONN:
+        printf("setsockopt %s failed: The connection has been reset when SO_KEEPALIVE is set.\n", optionName);
+        break;
+      case WSAENOTSOCK:
+        printf("setsockopt %s failed: The descriptor is not a socket.\n", optionName);
+        break;
+      default:
+        printf("setsockopt %s failed: An unknown error code %d occured.\n", optionName, errorCode);
+        break;
+    }
+    return result;
+  }
 
-  // resolve address details and open a new socket.
-  addrinfo* information = NULL;
-  if (resolveAddress(host, hints, &information) == 0) {
-    auto socket = createSocket(information);
-    if (socket != INVALID_SOCKET) {
-      if (connectSocket(socket, &information) == 0) {
-        send(socket, "A message from the client!");
-        receive(socket);
-        shutdownSocket(socket, SD_BOTH);
-      }
-      closeSocket(socket);
+  auto actual = 0;
+  auto actualLength = (int)sizeof(actual);
+  result = getsockopt(socket, level, option, (char*)&actual, &actualLength);
+  if (result == 0) {
+    if (actual != value) {
+      printf("setsockopt %s adjusted: requested %d, read back %d.\n", optionName, value, actual);
+    } else if (gVerbose) {
+      printf("setsockopt %s succeeded: requested %d, read back %d.\n", optionName, value, actual);
+    }
+  } else {
+    auto errorCode = WSAGetLastError();
+    switch (errorCode) {
+      case WSANOTINITIALISED:
+        printf("getsockopt %s failed: A successful WSAStartup call must occur before using this function.\n", optionName);
+        break;
+      case WSAENETDOWN:
+        printf("getsockopt %s failed: The network subsystem has failed.\n", optionName);
+        break;
+      case WSAEFAULT:
+        printf("getsockopt %s failed: The option value or length is not in a valid part of the process address space.\n", optionName);
+        break;
+      case WSAEINPROGRESS:
+        printf("getsockopt %s failed: A blocking socket call or callback is in progress.\n", optionName);
+        break;
+      case WSAEINVAL:
+        printf("getsockopt %s failed: The level is unknown or invalid.\n", optionName);
+        break;
+      case WSAENOPROTOOPT:
+        printf("getsockopt %s failed: The option is unknown or unsupported by the protocol family.\n", optionName);
+        break;
+      case WSAENOTSOCK:
+        printf("getsockopt %s failed: The descriptor is not a socket.\n", optionName);
+        break;
+      default:
+        printf("getsockopt %s failed: An unknown error code %d occured.\n", optionName, errorCode);
+        break;
     }
   }
-  freeaddrinfo(information);
+  return result;
 }
 
-int main(int argc, char* argv[]) {
-  auto executionStatus = initWSA();
-  if (executionStatus == 0) {
-    if (argc > 1) {
-      startTcpClient(argv[1]);
-    } else {
-      startTcpServer();
+// Apply an integer control code to the target socket. Unlike socket options,
+// these controls cannot be read back, so only the outcome can be reported.
+//
+// @param socket The target socket.
+// @param controlCode The control code of the operation.
+// @param controlName The name of the control code used in the report.
+// @param value The value for the control.
+// @returns 0 on a success and SOCKET_ERROR on an error.
+int setSocketControl(SOCKET socket, DWORD controlCode, const char* controlName, int value) {
+  DWORD bytesReturned = 0;
+  auto result = WSAIoctl(socket, controlCode, &value, sizeof(value), NULL, 0, &bytesReturned, NULL, NULL);
+  if (result == 0) {
+    if (gVerbose) {
+      printf("WSAIoctl %s succeeded: set to %d (no read back available).\n", controlName, value);
+    }
+  } else {
+    auto errorCode = WSAGetLastError();
+    switch (errorCode) {
+      case WSAENETDOWN:
+        printf("WSAIoctl %s failed: The network subsystem has failed.\n", controlName);
+        break;
+      case WSAEFAULT:
+        printf("WSAIoctl %s failed: The input buffer is not in a valid part of the user address space.\n", controlName);
+        break;
+      case WSAEINVAL:
+        printf("WSAIoctl %s failed: The control code is not valid or not supported for this socket.\n", controlName);
+        break;
+      case WSAEINPROGRESS:
+        printf("WSAIoctl %s failed: A blocking socket call or callback is in progress.\n", controlName);
+        break;
+      case WSAENOTSOCK:
+        printf("WSAIoctl %s failed: The descriptor is not a socket.\n", controlName);
+        break;
+      case WSAEOPNOTSUPP:
+        printf("WSAIoctl %s failed: The control code is not supported by this version of Windows.\n", controlName);
+        break;
+      case WSAEWOULDBLOCK:
+        printf("WSAIoctl %s failed: The socket is marked as nonblocking and the operation would block.\n", controlName);
+        break;
+      default:
+        printf("WSAIoctl %s failed: An unknown error code %d occured.\n", controlName, errorCode);
+        break;
+    }
+  }
+  return result;
+}
+
+// Apply the options of the given profile which must be set before the socket
+// is connected or starts listening. The buffer sizes are set at this stage, so
+// that the TCP window scaling gets negotiated based on them in the handshake.
+//
+// @param socket The target socket.
+// @param profile The socket tuning profile to be applied.
+// @param listening Whether the socket is going to be a listening socket.
+void tuneUnconnectedSocket(SOCKET socket, const SocketProfile& profile, bool listening) {
+  if (profile.loopbackFastPath != 0) {
+    setSocketControl(socket, SIO_LOOPBACK_FAST_PATH, "SIO_LOOPBACK_FAST_PATH", profile.loopbackFastPath);
+  }
+  if (profile.sendBufferSize != 0) {
+    setSocketOption(socket, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", profile.sendBufferSize);
+  }
+  if (profile.receiveBufferSize != 0) {
+    setSocketOption(socket, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", profile.receiveBufferSize);
+  }
+  if (listening && profile.fastOpen != 0) {
+    setSocketOption(socket, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", profile.fastOpen);
+  }
+}
+
+// Apply the options of the given profile which are set for each connected
+// socket. These are not reliably inherited from the listening socket, so the
+// server applies these separately for each of the accepted client sockets.
+//
+// @param socket The target socket.
+// @param profile The socket tuning profile to be applied.
+void tuneConnectedSocket(SOCKET socket, const SocketProfile& profile) {
+  if (profile.noDelay != 0) {
+    setSocketOption(socket, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", profile.noDelay);
+  }
+  if (profile.ackFrequency != 0) {
+    setSocketControl(socket, SIO_TCP_SET_ACK_FREQUENCY, "SIO_TCP_SET_ACK_FREQUENCY", profile.ackFrequency);
+  }
+}
+
+// Pin the calling thread to a single core, which is selected with the given
+// index in a round-robin manner. This keeps the caches of the thread warm as
+// the scheduler can no longer migrate the thread between the cores. The mask
+// is verified by setting it again as the function returns the previous mask.
+// The server workers use the lower half of the cores and the client threads
+// the upper half, so that a client and the worker serving it do not share a
+// core when both are run in-process over loopback.
+//
+// @param index The index of the thread.
+// @param isClient Whether the thread runs a client connection.
+void pinThread(int index, bool isClient) {
+  SYSTEM_INFO systemInfo;
+  GetSystemInfo(&systemInfo);
+  auto cores = std::min<DWORD>(systemInfo.dwNumberOfProcessors, sizeof(DWORD_PTR) * 8);
+  auto serverCores = std::max<DWORD>(cores / 2, 1);
+  auto core = (DWORD)index % serverCores;
+  if (isClient && cores > serverCores) {
+    core = serverCores + (DWORD)index % (cores - serverCores);
+  }
+  auto mask = (DWORD_PTR)1 << core;
+  auto thread = GetCurrentThread();
+  if (SetThreadAffinityMask(thread, mask) == 0) {
+    printf("SetThreadAffinityMask failed: An error code %lu occured.\n", GetLastError());
+  } else {
+    auto actual = SetThreadAffinityMask(thread, mask);
+    if (actual != mask) {
+      printf("SetThreadAffinityMask adjusted: %s %d requested mask 0x%llx, read back 0x%llx.\n", isClient ? "client" : "worker", index, (unsigned long long)mask, (unsigned long long)actual);
+    } else if (gVerbose) {
+      printf("SetThreadAffinityMask succeeded: %s %d pinned to core %lu.\n", isClient ? "client" : "worker", index, core);
+    }
+  }
+}
+
+// Start a new thread with a small reserved stack size. This allows running a
+// large number of threads e.g. when serving thousands of clients concurrently.
+//
+// @param function The function to be run within the new thread.
+// @param parameter The parameter to be passed to the thread function.
+// @returns A handle to the new thread or NULL on an error.
+HANDLE startThread(LPTHREAD_START_ROUTINE function, LPVOID parameter) {
+  auto thread = CreateThread(NULL, WORKER_STACK_SIZE, function, parameter, STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
+  if (thread == NULL) {
+    printf("CreateThread failed: An error code %lu occured.\n", GetLastError());
+  }
+  return thread;
+}
+
+// Get the current time from the high-resolution performance counter.
+//
+// @returns The current time in seconds.
+double getTime() {
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+// Make the following close of the socket abortive. The benchmark server uses
+// this after the client has closed its end, so that the connection is reset
+// instead of left in TIME_WAIT. This keeps the ephemeral ports of the client
+// available when thousands of connections are opened and closed in quick
+// succession. Any data still unsent by the server is discarded by the reset.
+//
+// @param socket The target socket.
+// @returns 0 on a success and SOCKET_ERROR on an error.
+int resetSocket(SOCKET socket) {
+  linger value;
+  value.l_onoff = 1;
+  value.l_linger = 0;
+  auto result = setsockopt(socket, SOL_SOCKET, SO_LINGER, (const char*)&value, sizeof(value));
+  if (result == SOCKET_ERROR) {
+    printf("setsockopt SO_LINGER failed: An error code %d occured.\n", WSAGetLastError());
+  }
+  return result;
+}
+
+// The header at the start of a capture file.
+struct CaptureHeader {
+  char   magic[4]; // The CAPTURE_MAGIC identifying the file.
+  u_long version;  // The CAPTURE_VERSION of the record layout.
+};
+
+// A single event of a captured connection. The records are written in the host
+// byte order and are kept 8-byte aligned, so that a memory-mapped capture can
+// be read in place. Each record is followed by the stored part of the payload,
+// padded to a multiple of 8 bytes. The records of a connection are in order,
+// but the records of different connections may be interleaved in any order.
+struct CaptureRecord {
+  long long      time;       // The nanoseconds since the start of the capture.
+  u_long         connection; // The index of the connection within the capture.
+  u_long         id;         // The id of the frame.
+  u_long         length;     // The payload length of the frame.
+  unsigned short direction;  // One of the CAPTURE_* record types.
+  unsigned short stored;     // The number of payload bytes following the record.
+};
+
+// A capture file being written by a server. The workers collect the records
+// of their connection and append them to the file under the lock, while the
+// accepting thread periodically flushes the file.
+struct CaptureWriter {
+  FILE*            file;
+  CRITICAL_SECTION lock;
+  const char*      path;
+  double           startTime;
+  int              payloadLimit;
+};
+
+// Open a capture file for writing and write the capture header into it. The
+// capture is left closed when no path is given.
+//
+// @param capture The capture to be opened.
+// @param path The path of the capture file or NULL.
+// @param payloadLimit The number of payload bytes stored for each request.
+// @returns 0 on a success and a non-zero on an error.
+int openCaptureWriter(CaptureWriter& capture, const char* path, int payloadLimit) {
+  capture.file = NULL;
+  capture.path = path;
+  if (path == NULL) {
+    return 0;
+  }
+  capture.file = fopen(path, "wb");
+  if (capture.file == NULL) {
+    printf("fopen failed: The file %s cannot be opened for writing.\n", path);
+    return 1;
+  }
+  CaptureHeader header;
+  memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = CAPTURE_VERSION;
+  fwrite(&header, sizeof(header), 1, capture.file);
+  InitializeCriticalSection(&capture.lock);
+  capture.startTime = getTime();
+  capture.payloadLimit = payloadLimit;
+  if (gVerbose) {
+    printf("capturing the traffic into %s.\n", path);
+  }
+  return 0;
+}
+
+// Flush the buffered records of an open capture into the file.
+//
+// @param capture The target capture.
+void flushCaptureWriter(CaptureWriter& capture) {
+  if (capture.file != NULL) {
+    EnterCriticalSection(&capture.lock);
+    fflush(capture.file);
+    LeaveCriticalSection(&capture.lock);
+  }
+}
+
+// Close an open capture. All the workers must have finished before this.
+//
+// @param capture The capture to be closed.
+void closeCaptureWriter(CaptureWriter& capture) {
+  if (capture.file != NULL) {
+    fclose(capture.file);
+    DeleteCriticalSection(&capture.lock);
+    capture.file = NULL;
+    printf("capture written to %s.\n", capture.path);
+  }
+}
+
+// The limits applied by the server when admitting new clients. Zero values
+// disable the corresponding limit.
+struct AdmissionOptions {
+  int maxConnections; // The maximum number of concurrently served clients.
+  int rate;           // The new connections per second allowed from an address.
+  int burst;          // The number of connections an address may open at once.
+  int acceptBatch;    // The maximum number of connections accepted per wakeup.
+};
+
+// The options of a TCP echo server.
+struct ServerOptions {
+  AdmissionOptions admission;
+  bool             reorder;        // Answer the pipelined requests in reverse order.
+  bool             resetOnClose;   // Reset the connections closed by the clients.
+  const char*      capturePath;    // The file where to capture the traffic or NULL.
+  int              capturePayload; // The payload bytes stored for each captured request.
+};
+
+// A token bucket limiting the rate of new connections from a single address.
+struct TokenBucket {
+  u_long address;
+  double tokens;
+  double updated;
+};
+
+// The state of a TCP echo server. Each accepted client is served by its own
+// worker thread, which echoes all the received frames back to the client. The
+// admission counters are only touched by the thread accepting the clients.
+struct Server {
+  SOCKET                   socket;
+  HANDLE                   thread;
+  const SocketProfile*     profile;
+  AdmissionOptions         admission;
+  std::vector<TokenBucket> buckets;
+  bool                     reorder;
+  bool                     resetOnClose;
+  volatile LONG            running;
+  volatile LONG            workers;
+  int                      nextWorker;
+  long long                accepted;
+  long long                rejectedByLimit;
+  long long                rejectedByRate;
+  long long                failedAccepts;
+  long long                saturatedBatches;
+  bool                     isReporting; // Report the admission counters periodically.
+  CaptureWriter            capture;
+};
+
+// The parameters of a worker thread serving a single accepted client.
+struct Worker {
+  Server*           server;
+  SOCKET            socket;
+  int               index;
+  std::vector<char> records;     // The capture records not yet written.
+  double            recordsTime; // The time when the records were last written.
+};
+
+// Add a record into the capture records of the worker. Only the inbound frames
+// store their payload, as the echoed responses carry the same payload back.
+//
+// @param worker The worker serving the client.
+// @param direction One of the CAPTURE_* record types.
+// @param frame The frame starting with its header or NULL for open and close.
+// @param available The number of payload bytes available after the header.
+void addCaptureRecord(Worker& worker, int direction, const char* frame, int available) {
+  auto& capture = worker.server->capture;
+  if (capture.file == NULL) {
+    return;
+  }
+  CaptureRecord record;
+  ZeroMemory(&record, sizeof(record));
+  record.time = (long long)((getTime() - capture.startTime) * 1e9);
+  record.connection = (u_long)worker.index;
+  record.direction = (unsigned short)direction;
+  if (frame != NULL) {
+    auto header = readFrameHeader(frame);
+    record.id = header.id;
+    record.length = header.length;
+    record.stored = (unsigned short)std::min<long long>(std::min<long long>(header.length, available), capture.payloadLimit);
+  }
+  auto offset = worker.records.size();
+  worker.records.resize(offset + sizeof(record) + ((record.stored + 7) & ~7));
+  memcpy(worker.records.data() + offset, &record, sizeof(record));
+  if (record.stored > 0) {
+    memcpy(worker.records.data() + offset + sizeof(record), frame + sizeof(FrameHeader), record.stored);
+  }
+}
+
+// Append the collected capture records of the worker into the capture file.
+// The records are written at once, so they are not split by other workers.
+// Unless forced, the records are written only after CAPTURE_BATCH bytes or
+// CAPTURE_INTERVAL seconds have been collected, so that the workers of a busy
+// server rarely contend for the lock of the capture.
+//
+// @param worker The worker serving the client.
+// @param isForced Whether to write the records regardless of their amount.
+void writeCaptureRecords(Worker& worker, bool isForced) {
+  auto& capture = worker.server->capture;
+  if (worker.records.empty()) {
+    return;
+  }
+  auto now = getTime();
+  if (isForced || worker.records.size() >= CAPTURE_BATCH || now - worker.recordsTime >= CAPTURE_INTERVAL) {
+    EnterCriticalSection(&capture.lock);
+    fwrite(worker.records.data(), 1, worker.records.size(), capture.file);
+    LeaveCriticalSection(&capture.lock);
+    worker.records.clear();
+    worker.recordsTime = now;
+  }
+}
+
+// Echo the complete frames found from the start of the input buffer. All the
+// frames are copied into the output buffer and sent back with a single send.
+// When the server reorders the responses, the frames are written in reverse,
+// so the responses to the pipelined requests are answered out of order. The
+// captured responses are recorded in the order they were sent.
+//
+// @param worker The worker serving the client.
+// @param input The buffer holding the received data.
+// @param length The amount of the received data.
+// @param output The buffer to hold the responses, as large as the input.
+// @returns The number of consumed bytes or SOCKET_ERROR on an error.
+int echoFrames(Worker& worker, const char* input, int length, char* output) {
+  auto consumed = 0;
+  while (length - consumed >= (int)sizeof(FrameHeader)) {
+    auto frameSize = getFrameSize(input + consumed);
+    if (frameSize > length - consumed) {
+      break;
+    }
+    addCaptureRecord(worker, CAPTURE_INBOUND, input + consumed, (int)frameSize - (int)sizeof(FrameHeader));
+    consumed += (int)frameSize;
+  }
+
+  for (auto offset = 0; offset < consumed;) {
+    auto frameSize = (int)getFrameSize(input + offset);
+    auto target = worker.server->reorder ? consumed - offset - frameSize : offset;
+    memcpy(output + target, input + offset, frameSize);
+    offset += frameSize;
+  }
+  if (consumed > 0 && sendAll(worker.socket, output, consumed) == SOCKET_ERROR) {
+    return SOCKET_ERROR;
+  }
+  for (auto offset = 0; offset < consumed; offset += (int)getFrameSize(output + offset)) {
+    addCaptureRecord(worker, CAPTURE_OUTBOUND, output + offset, 0);
+  }
+  return consumed;
+}
+
+// Echo a frame which does not fit into the worker buffer. The received part
+// of the frame is sent right away and the rest is relayed as it arrives, so
+// the large frames are always answered in order.
+//
+// @param worker The worker serving the client.
+// @param buffer The buffer holding the start of the frame.
+// @param length The amount of data in the buffer.
+// @param bufferSize The size of the buffer.
+// @returns 0 on a connection close, SOCKET_ERROR on an error and 1 otherwise.
+int relayFrame(Worker& worker, char* buffer, int length, int bufferSize) {
+  char header[sizeof(FrameHeader)];
+  memcpy(header, buffer, sizeof(header));
+  addCaptureRecord(worker, CAPTURE_INBOUND, buffer, length - (int)sizeof(header));
+  auto remaining = getFrameSize(buffer) - length;
+  if (sendAll(worker.socket, buffer, length) == SOCKET_ERROR) {
+    return SOCKET_ERROR;
+  }
+  while (remaining > 0) {
+    auto result = receive(worker.socket, buffer, (int)std::min<long long>(remaining, bufferSize));
+    if (result <= 0) {
+      return result;
+    }
+    if (sendAll(worker.socket, buffer, result) == SOCKET_ERROR) {
+      return SOCKET_ERROR;
+    }
+    remaining -= result;
+  }
+  addCaptureRecord(worker, CAPTURE_OUTBOUND, header, 0);
+  return 1;
+}
+
+// Wait for input from the client of a capturing worker. The wait times out in
+// CAPTURE_INTERVAL, when the staged capture records are written, so that the
+// records of an idle connection reach the capture file without waiting for its
+// next request. The timeout also lets the worker notice that the server is
+// being stopped, so that the capture can be completed with its close record.
+//
+// @param worker The worker serving the client.
+// @returns true when input or an error is pending and false on a server stop.
+bool waitForInput(Worker& worker) {
+  while (worker.server->running) {
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(worker.socket, &readSet);
+    timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = (long)(CAPTURE_INTERVAL * 1e6);
+    if (select(0, &readSet, NULL, NULL, &timeout) != 0) {
+      return true;
+    }
+    writeCaptureRecords(worker, true);
+  }
+  return false;
+}
+
+// Serve a single client by echoing back all the frames that are received from
+// it until the client closes the connection. This function is run by a
+// separate worker thread for each accepted client. A capturing worker waits
+// for the input with a timeout and stops serving when the server is stopped.
+//
+// @param parameter A pointer to the worker, which is owned by the thread.
+// @returns 0 as the exit code of the thread.
+DWORD WINAPI serveClient(LPVOID parameter) {
+  auto worker = (Worker*)parameter;
+  auto& profile = *worker->server->profile;
+  if (profile.pinThreads) {
+    pinThread(worker->index, false);
+  }
+
+  // the client socket inherits the nonblocking mode from the server socket.
+  u_long nonblocking = 0;
+  ioctlsocket(worker->socket, FIONBIO, &nonblocking);
+  tuneConnectedSocket(worker->socket, profile);
+  addCaptureRecord(*worker, CAPTURE_OPEN, NULL, 0);
+
+  std::vector<char> input(WORKER_BUFFER_SIZE);
+  std::vector<char> output(WORKER_BUFFER_SIZE);
+  auto isCapturing = worker->server->capture.file != NULL;
+  auto filled = 0;
+  auto result = 0;
+  while ((!isCapturing || waitForInput(*worker)) && (result = receive(worker->socket, input.data() + filled, (int)input.size() - filled)) > 0) {
+    filled += result;
+    auto consumed = echoFrames(*worker, input.data(), filled, output.data());
+    if (consumed == SOCKET_ERROR) {
+      break;
+    }
+    filled -= consumed;
+    memmove(input.data(), input.data() + consumed, filled);
+    if (filled >= (int)sizeof(FrameHeader) && getFrameSize(input.data()) > (long long)input.size()) {
+      result = relayFrame(*worker, input.data(), filled, (int)input.size());
+      if (result <= 0) {
+        break;
+      }
+      filled = 0;
+    }
+    writeCaptureRecords(*worker, false);
+  }
+  if (result == 0 && worker->server->resetOnClose) {
+    resetSocket(worker->socket);
+  } else {
+    shutdownSocket(worker->socket, SD_BOTH);
+  }
+  closeSocket(worker->socket);
+  addCaptureRecord(*worker, CAPTURE_CLOSE, NULL, 0);
+  writeCaptureRecords(*worker, true);
+  InterlockedDecrement(&worker->server->workers);
+  delete worker;
+  return 0;
+}
+
+// Take a token from the bucket of the given address. The buckets are kept in a
+// fixed size table indexed by the high bits of a multiplicative hash of the
+// address, so that the addresses of a subnet are spread over the table. The
+// bucket of an address is searched from RATE_LIMIT_PROBES consecutive slots.
+// A new address takes an empty slot or a slot whose bucket has refilled, as
+// such a bucket no longer limits anyone. When neither is found, the address
+// shares the bucket of its first slot, which keeps the rate limiting free of
+// allocations at the cost of being occasionally too strict.
+//
+// @param server The server holding the buckets.
+// @param address The IPv4 address of the client in network byte order.
+// @param now The current time in seconds.
+// @returns true if a token was available and false if the client is limited.
+bool takeToken(Server& server, u_long address, double now) {
+  auto& admission = server.admission;
+  auto home = ((unsigned)ntohl(address) * 2654435761u) >> (32 - RATE_LIMIT_BITS);
+  TokenBucket* bucket = NULL;
+  for (auto i = 0; i < RATE_LIMIT_PROBES && bucket == NULL; i++) {
+    auto& candidate = server.buckets[(home + i) % RATE_LIMIT_BUCKETS];
+    if (candidate.address == address) {
+      bucket = &candidate;
+    }
+  }
+  for (auto i = 0; i < RATE_LIMIT_PROBES && bucket == NULL; i++) {
+    auto& candidate = server.buckets[(home + i) % RATE_LIMIT_BUCKETS];
+    if (candidate.address == 0 || candidate.tokens + (now - candidate.updated) * admission.rate >= admission.burst) {
+      candidate.address = address;
+      candidate.tokens = admission.burst;
+      candidate.updated = now;
+      bucket = &candidate;
+    }
+  }
+  if (bucket == NULL) {
+    bucket = &server.buckets[home];
+  }
+  bucket->tokens = std::min((double)admission.burst, bucket->tokens + (now - bucket->updated) * admission.rate);
+  bucket->updated = now;
+  if (bucket->tokens < 1.0) {
+    return false;
+  }
+  bucket->tokens -= 1.0;
+  return true;
+}
+
+// Decide whether a pending client is admitted. This condition function is
+// called by WSAAccept before the client socket is created, so the rejected
+// clients never get a socket, a worker thread nor any buffers allocated.
+//
+// @param callerId The address of the client.
+// @param callbackData A pointer to the server.
+// @returns CF_ACCEPT to admit the client and CF_REJECT to reject it.
+int CALLBACK admitClient(LPWSABUF callerId, LPWSABUF, LPQOS, LPQOS, LPWSABUF, LPWSABUF, GROUP*, DWORD_PTR callbackData) {
+  auto server = (Server*)callbackData;
+  auto& admission = server->admission;
+  if (admission.maxConnections > 0 && server->workers >= admission.maxConnections) {
+    server->rejectedByLimit++;
+    return CF_REJECT;
+  }
+  auto address = (const sockaddr*)callerId->buf;
+  if (admission.rate > 0 && address != NULL && address->sa_family == AF_INET) {
+    if (!takeToken(*server, ((const sockaddr_in*)address)->sin_addr.s_addr, getTime())) {
+      server->rejectedByRate++;
+      return CF_REJECT;
+    }
+  }
+  return CF_ACCEPT;
+}
+
+// Print the admission counters of the server.
+//
+// @param server The server whose counters are printed.
+void printAdmission(const Server& server) {
+  printf("admission: %lld accepted, %lld rejected by the connection limit, %lld rejected by the rate limit, %lld failed accepts, %lld saturated accept batches.\n",
+    server.accepted,
+    server.rejectedByLimit,
+    server.rejectedByRate,
+    server.failedAccepts,
+    server.saturatedBatches);
+}
+
+// Hand an accepted client over to a new worker thread.
+//
+// @param server The server which accepted the client.
+// @param clientSocket The socket of the accepted client.
+void startWorker(Server& server, SOCKET clientSocket) {
+  auto worker = new Worker { &server, clientSocket, server.nextWorker++, std::vector<char>(), getTime() };
+  InterlockedIncrement(&server.workers);
+  auto thread = startThread(serveClient, worker);
+  if (thread != NULL) {
+    CloseHandle(thread);
+  } else {
+    InterlockedDecrement(&server.workers);
+    closeSocket(clientSocket);
+    delete worker;
+  }
+}
+
+// Accept clients until the server is stopped and hand each of the accepted
+// clients over to a new worker thread. The nonblocking server socket is waited
+// with select, after which up to a batch of pending connections are drained on
+// each wakeup. A batch counts accepted and refused connections, and a filled
+// batch is counted as saturated when more connections are still pending after
+// it, which is checked with a select without a timeout. The select timeout
+// lets the thread notice when the server is being stopped, and the capture of
+// the server is flushed on each wakeup so that it stays current on the disk.
+// An accept failing for other reasons, such as WSAENOBUFS or WSAEMFILE while
+// the resources are exhausted, is counted as a failed accept and the thread
+// backs off for the select timeout, instead of spinning on the pending clients.
+// The standalone server reports its admission counters periodically also when
+// quiet, while the in-process servers report them once as they are stopped.
+//
+// @param parameter A pointer to the server.
+// @returns 0 as the exit code of the thread.
+DWORD WINAPI acceptClients(LPVOID parameter) {
+  auto server = (Server*)parameter;
+  auto reportTime = getTime();
+  auto reported = -1LL;
+  while (server->running) {
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(server->socket, &readSet);
+    timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = ACCEPT_TIMEOUT;
+    auto result = select(0, &readSet, NULL, NULL, &timeout);
+    if (result == SOCKET_ERROR) {
+      printf("select failed: An error code %d occured while accepting.\n", WSAGetLastError());
+      break;
+    }
+
+    auto batch = 0;
+    auto isFailed = false;
+    while (result > 0 && batch < server->admission.acceptBatch) {
+      auto clientSocket = acceptClient(server->socket, admitClient, (DWORD_PTR)server);
+      if (clientSocket != INVALID_SOCKET) {
+        server->accepted++;
+        startWorker(*server, clientSocket);
+      } else {
+        auto errorCode = WSAGetLastError();
+        if (errorCode == WSAEWOULDBLOCK) {
+          break;
+        } else if (errorCode != WSAECONNREFUSED) {
+          server->failedAccepts++;
+          isFailed = true;
+          break;
+        }
+      }
+      batch++;
+    }
+    if (isFailed) {
+      Sleep(ACCEPT_TIMEOUT / 1000);
+    }
+    if (batch == server->admission.acceptBatch) {
+      FD_ZERO(&readSet);
+      FD_SET(server->socket, &readSet);
+      timeout.tv_sec = 0;
+      timeout.tv_usec = 0;
+      if (select(0, &readSet, NULL, NULL, &timeout) > 0) {
+        server->saturatedBatches++;
+      }
+    }
+    flushCaptureWriter(server->capture);
+
+    auto now = getTime();
+    auto total = server->accepted + server->rejectedByLimit + server->rejectedByRate + server->failedAccepts;
+    if (server->isReporting && now - reportTime >= ADMISSION_REPORT && total != reported) {
+      printAdmission(*server);
+      reportTime = now;
+      reported = total;
+    }
+  }
+  return 0;
+}
+
+// Open a TCP server socket and start listening for incoming connections. The
+// options of the given profile are applied before the socket gets bound, and
+// the options which are not reliably inherited by the accepted client sockets
+// are applied again to each of them by the worker serving the client.
+// When admission limits are in use, the socket is set for conditional accept
+// so that the rejected clients are refused before the handshake completes.
+//
+// @param server The server to be opened.
+// @param profile The socket tuning profile for the server.
+// @param options The admission limits, response order and capture of the server.
+// @returns 0 on a success and a non-zero on an error.
+int openServer(Server& server, const SocketProfile& profile, const ServerOptions& options) {
+  auto& admission = options.admission;
+  server.socket = INVALID_SOCKET;
+  server.thread = NULL;
+  server.profile = &profile;
+  server.admission = admission;
+  server.reorder = options.reorder;
+  server.resetOnClose = options.resetOnClose;
+  server.capture.file = NULL;
+  server.buckets.assign(admission.rate > 0 ? RATE_LIMIT_BUCKETS : 0, TokenBucket { 0, 0.0, 0.0 });
+  server.running = 1;
+  server.workers = 0;
+  server.nextWorker = 0;
+  server.accepted = 0;
+  server.rejectedByLimit = 0;
+  server.rejectedByRate = 0;
+  server.failedAccepts = 0;
+  server.saturatedBatches = 0;
+  server.isReporting = false;
+
+  // create an address descriptor for a TCP server socket.
+  addrinfo hints;
+  ZeroMemory(&hints, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  hints.ai_flags = AI_PASSIVE;
+
+  // resolve address details and open a new listening socket.
+  auto result = -1;
+  addrinfo* information = NULL;
+  if (resolveAddress(NULL, hints, &information) == 0) {
+    server.socket = createSocket(information);
+    if (server.socket != INVALID_SOCKET) {
+      tuneUnconnectedSocket(server.socket, profile, true);
+      if (admission.maxConnections > 0 || admission.rate > 0) {
+        setSocketOption(server.socket, SOL_SOCKET, SO_CONDITIONAL_ACCEPT, "SO_CONDITIONAL_ACCEPT", 1);
+      }
+      if (bindSocket(server.socket, &information) == 0) {
+        result = listenSocket(server.socket, profile.backlog);
+      }
+      if (result == 0) {
+        u_long nonblocking = 1;
+        result = ioctlsocket(server.socket, FIONBIO, &nonblocking);
+        if (result != 0) {
+          printf("ioctlsocket FIONBIO failed: An error code %d occured.\n", WSAGetLastError());
+        }
+      }
+      if (result == 0) {
+        result = openCaptureWriter(server.capture, options.capturePath, options.capturePayload);
+      }
+      if (result != 0) {
+        closeSocket(server.socket);
+        server.socket = INVALID_SOCKET;
+      }
+    }
+  }
+  freeaddrinfo(information);
+  return result;
+}
+
+// Open a TCP server and start accepting clients within a separate thread. This
+// is used to run the server in-process when performing loopback load tests.
+//
+// @param server The server to be started.
+// @param profile The socket tuning profile for the server.
+// @param options The admission limits, response order and capture of the server.
+// @returns 0 on a success and a non-zero on an error.
+int startServer(Server& server, const SocketProfile& profile, const ServerOptions& options) {
+  auto result = openServer(server, profile, options);
+  if (result == 0) {
+    server.thread = startThread(acceptClients, &server);
+    if (server.thread == NULL) {
+      closeSocket(server.socket);
+      closeCaptureWriter(server.capture);
+      result = -1;
+    }
+  }
+  return result;
+}
+
+// Stop a server started with the startServer function. The accepting thread
+// notices the stop within the select timeout, after which the server socket
+// is closed and all the active workers are waited to finish serving clients
+// before the capture of the server is closed.
+//
+// @param server The server to be stopped.
+void stopServer(Server& server) {
+  server.running = 0;
+  WaitForSingleObject(server.thread, INFINITE);
+  CloseHandle(server.thread);
+  closeSocket(server.socket);
+  while (server.workers > 0) {
+    Sleep(1);
+  }
+  closeCaptureWriter(server.capture);
+  printAdmission(server);
+}
+
+// The standalone server being stopped by a console control event or NULL.
+Server* volatile gServer = NULL;
+
+// Stop the standalone server on a console control event such as Ctrl+C. For
+// the events after which the process is ended as the handler returns, the
+// handler waits for the server to finish, so that its capture gets completed.
+//
+// @param controlType The type of the console control event.
+// @returns TRUE when the event was handled and FALSE otherwise.
+BOOL WINAPI stopOnConsoleControl(DWORD controlType) {
+  auto server = gServer;
+  if (server == NULL) {
+    return FALSE;
+  }
+  server->running = 0;
+  if (controlType != CTRL_C_EVENT && controlType != CTRL_BREAK_EVENT) {
+    while (gServer != NULL) {
+      Sleep(10);
+    }
+  }
+  return TRUE;
+}
+
+// Run the standalone server until it is stopped. A capturing server installs a
+// console control handler, so that Ctrl+C stops the server and its workers and
+// the capture gets closed with the close records of the live connections.
+//
+// @param profile The socket tuning profile for the server.
+// @param options The admission limits, response order and capture of the server.
+void startTcpServer(const SocketProfile& profile, const ServerOptions& options) {
+  Server server;
+  if (openServer(server, profile, options) == 0) {
+    server.isReporting = true;
+    if (server.capture.file != NULL) {
+      gServer = &server;
+      SetConsoleCtrlHandler(stopOnConsoleControl, TRUE);
+    }
+    printf("waiting for clients to connect...\n");
+    acceptClients(&server);
+    closeSocket(server.socket);
+    while (server.workers > 0) {
+      Sleep(1);
+    }
+    if (server.capture.file != NULL) {
+      closeCaptureWriter(server.capture);
+      printAdmission(server);
+      SetConsoleCtrlHandler(stopOnConsoleControl, FALSE);
+      gServer = NULL;
+    }
+  }
+}
+
+// The parameters of a load generator run.
+struct LoadOptions {
+  int  connections; // The number of concurrent client connections.
+  int  requests;    // The number of requests sent by each connection.
+  int  size;        // The size of each request payload in bytes.
+  int  depth;       // The number of requests kept in flight per connection.
+};
+
+// The results of a load generator run.
+struct LoadResult {
+  double    elapsed;  // The duration of the run in seconds.
+  long long requests; // The number of completed requests.
+  int       failures; // The number of connections that did not complete.
+  double    p50;      // The median request latency in microseconds.
+  double    p99;      // The 99th percentile request latency in microseconds.
+};
+
+// The state of a single load generator connection run in its own thread.
+struct LoadConnection {
+  addrinfo*            address;
+  const SocketProfile* profile;
+  const LoadOptions*   options;
+  HANDLE               startEvent;
+  volatile LONG*       ready;
+  int                  index;
+  std::vector<double>  latencies;
+};
+
+// Perform the request-response round trips, where each request is sent only
+// after the echoed response of the previous request has been fully received.
+//
+// @param socket A connected client socket.
+// @param connection The load connection where to store the latencies.
+void sendRequests(SOCKET socket, LoadConnection& connection) {
+  auto& options = *connection.options;
+  auto frameSize = (int)sizeof(FrameHeader) + options.size;
+  std::vector<char> request(frameSize, 'x');
+  std::vector<char> response(frameSize);
+  for (auto i = 0; i < options.requests; i++) {
+    auto startTime = getTime();
+    writeFrameHeader(request.data(), (u_long)i, (u_long)options.size);
+    if (sendAll(socket, request.data(), frameSize) == SOCKET_ERROR) {
+      break;
+    }
+    if (receiveAll(socket, response.data(), frameSize) <= 0) {
+      break;
+    }
+    if (readFrameHeader(response.data()).id != (u_long)i) {
+      printf("recv failed: The response id does not match the request id %d.\n", i);
+      break;
+    }
+    connection.latencies.push_back(getTime() - startTime);
+  }
+}
+
+// A slot in the pending request table of a pipelined connection.
+struct PendingRequest {
+  u_long id;
+  bool   active;
+  double sendTime;
+};
+
+// Pipeline the requests by keeping up to the depth of requests in flight and
+// reading the responses concurrently. The socket is made nonblocking and
+// multiplexed with select. The pending requests are kept in a table with a
+// slot for each request in flight, which is allocated once per connection.
+// The slot index is stored in the low bits of the request id, so that each
+// response is matched to its request in constant time in any order.
+//
+// @param socket A connected client socket.
+// @param connection The load connection where to store the latencies.
+void pipelineRequests(SOCKET socket, LoadConnection& connection) {
+  auto& options = *connection.options;
+  auto frameSize = (long long)sizeof(FrameHeader) + options.size;
+  std::vector<char> request((size_t)frameSize, 'x');
+  std::vector<char> response(WORKER_BUFFER_SIZE);
+  std::vector<PendingRequest> pending(options.depth, PendingRequest { 0, false, 0.0 });
+  std::vector<int> freeSlots(options.depth);
+  for (auto i = 0; i < options.depth; i++) {
+    freeSlots[i] = options.depth - 1 - i;
+  }
+  auto freeCount = options.depth;
+  auto started = 0;
+  auto completed = 0;
+  auto requestOffset = frameSize;
+  char header[sizeof(FrameHeader)];
+  auto headerFilled = 0;
+  long long payloadRemaining = 0;
+
+  u_long nonblocking = 1;
+  ioctlsocket(socket, FIONBIO, &nonblocking);
+  while (completed < options.requests) {
+    // start the next request whenever the previous one is sent and a slot is free.
+    if (requestOffset == frameSize && freeCount > 0 && started < options.requests) {
+      auto slot = freeSlots[--freeCount];
+      auto id = ((u_long)started << PENDING_SLOT_BITS) | (u_long)slot;
+      pending[slot].id = id;
+      pending[slot].active = true;
+      pending[slot].sendTime = getTime();
+      writeFrameHeader(request.data(), id, (u_long)options.size);
+      requestOffset = 0;
+      started++;
+    }
+
+    fd_set readSet;
+    fd_set writeSet;
+    FD_ZERO(&readSet);
+    FD_ZERO(&writeSet);
+    FD_SET(socket, &readSet);
+    if (requestOffset < frameSize) {
+      FD_SET(socket, &writeSet);
+    }
+    if (select(0, &readSet, &writeSet, NULL, NULL) == SOCKET_ERROR) {
+      printf("select failed: An error code %d occured while pipelining.\n", WSAGetLastError());
+      break;
+    }
+
+    if (FD_ISSET(socket, &writeSet)) {
+      auto length = (int)std::min<long long>(frameSize - requestOffset, 0x7fffffff);
+      auto result = send(socket, request.data() + requestOffset, length, 0);
+      if (result == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK) {
+        printf("send failed: An error code %d occured while pipelining.\n", WSAGetLastError());
+        break;
+      } else if (result > 0) {
+        requestOffset += result;
+      }
+    }
+
+    if (FD_ISSET(socket, &readSet)) {
+      auto result = recv(socket, response.data(), (int)response.size(), 0);
+      if (result == 0) {
+        break;
+      } else if (result == SOCKET_ERROR) {
+        if (WSAGetLastError() == WSAEWOULDBLOCK) {
+          continue;
+        }
+        printf("recv failed: An error code %d occured while pipelining.\n", WSAGetLastError());
+        break;
+      }
+
+      // walk through the received frames and complete the matching requests.
+      auto now = getTime();
+      auto isValid = true;
+      for (auto offset = 0; offset < result && isValid;) {
+        if (headerFilled < (int)sizeof(header)) {
+          auto length = std::min((int)sizeof(header) - headerFilled, result - offset);
+          memcpy(header + headerFilled, response.data() + offset, length);
+          headerFilled += length;
+          offset += length;
+          if (headerFilled < (int)sizeof(header)) {
+            continue;
+          }
+          payloadRemaining = readFrameHeader(header).length;
+        }
+        auto length = (int)std::min<long long>(payloadRemaining, result - offset);
+        payloadRemaining -= length;
+        offset += length;
+        if (payloadRemaining == 0) {
+          auto id = readFrameHeader(header).id;
+          auto slot = (int)(id & ((1 << PENDING_SLOT_BITS) - 1));
+          if (slot >= options.depth || !pending[slot].active || pending[slot].id != id) {
+            printf("recv failed: An unexpected response id %lu was received.\n", (unsigned long)id);
+            isValid = false;
+            break;
+          }
+          connection.latencies.push_back(now - pending[slot].sendTime);
+          pending[slot].active = false;
+          freeSlots[freeCount++] = slot;
+          completed++;
+          headerFilled = 0;
+        }
+      }
+      if (!isValid) {
+        break;
+      }
+    }
+  }
+  nonblocking = 0;
+  ioctlsocket(socket, FIONBIO, &nonblocking);
+}
+
+// Run a single load generator connection. The connection is established and
+// tuned first, after which it waits for the start event and then performs the
+// request-response round trips where the server echoes each request back.
+//
+// @param parameter A pointer to the load connection.
+// @returns 0 as the exit code of the thread.
+DWORD WINAPI runLoadConnection(LPVOID parameter) {
+  auto connection = (LoadConnection*)parameter;
+  auto& profile = *connection->profile;
+  auto& options = *connection->options;
+  if (profile.pinThreads) {
+    pinThread(connection->index, true);
+  }
+
+  auto isReady = false;
+  auto socket = createSocket(connection->address);
+  if (socket != INVALID_SOCKET) {
+    tuneUnconnectedSocket(socket, profile, false);
+    if (connectSocket(socket, &connection->address) == 0) {
+      tuneConnectedSocket(socket, profile);
+      InterlockedIncrement(connection->ready);
+      isReady = true;
+      WaitForSingleObject(connection->startEvent, INFINITE);
+
+      connection->latencies.reserve(options.requests);
+      if (options.depth > 1) {
+        pipelineRequests(socket, *connection);
+      } else {
+        sendRequests(socket, *connection);
+      }
+      shutdownSocket(socket, SD_BOTH);
+    }
+    closeSocket(socket);
+  }
+  if (!isReady) {
+    InterlockedIncrement(connection->ready);
+  }
+  return 0;
+}
+
+// Get the value at the given percentile from the sorted set of samples.
+//
+// @param samples The samples sorted into an ascending order.
+// @param fraction The percentile as a fraction between 0.0 and 1.0.
+// @returns The value at the percentile or 0.0 if there are no samples.
+double getPercentile(const std::vector<double>& samples, double fraction) {
+  if (samples.empty()) {
+    return 0.0;
+  }
+  return samples[(size_t)(fraction * (samples.size() - 1) + 0.5)];
+}
+
+// Run the load generator against the target host. Each connection is run in
+// its own thread. The first connection is established alone so that its setup
+// and the applied socket options get reported, after which the reports are
+// silenced. The clock is started only after all connections are established.
+//
+// @param host The target host to connect to.
+// @param profile The socket tuning profile for the client sockets.
+// @param options The parameters of the load generator run.
+// @param result The results of the run.
+// @returns 0 on a success and a non-zero on an error.
+int runLoad(const char* host, const SocketProfile& profile, const LoadOptions& options, LoadResult& result) {
+  // create an address descriptor for a TCP client socket.
+  addrinfo hints;
+  ZeroMemory(&hints, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+
+  // resolve address details and start the connection threads.
+  addrinfo* information = NULL;
+  auto status = resolveAddress(host, hints, &information);
+  if (status == 0) {
+    auto verbose = gVerbose;
+    volatile LONG ready = 0;
+    auto startEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    std::vector<LoadConnection> connections(options.connections);
+    std::vector<HANDLE> threads;
+    for (auto i = 0; i < options.connections; i++) {
+      auto& connection = connections[i];
+      connection.address = information;
+      connection.profile = &profile;
+      connection.options = &options;
+      connection.startEvent = startEvent;
+      connection.ready = &ready;
+      connection.index = i;
+      auto thread = startThread(runLoadConnection, &connection);
+      if (thread != NULL) {
+        threads.push_back(thread);
+      } else {
+        InterlockedIncrement(&ready);
+      }
+      if (i == 0) {
+        while (ready == 0) {
+          Sleep(1);
+        }
+        gVerbose = false;
+      }
+    }
+    while (ready < options.connections) {
+      Sleep(1);
+    }
+
+    // start the run and wait for all the connections to complete.
+    auto startTime = getTime();
+    SetEvent(startEvent);
+    for (auto thread : threads) {
+      WaitForSingleObject(thread, INFINITE);
+      CloseHandle(thread);
+    }
+    result.elapsed = getTime() - startTime;
+    CloseHandle(startEvent);
+    gVerbose = verbose;
+
+    // collect the latencies of all the connections.
+    std::vector<double> latencies;
+    result.failures = 0;
+    for (const auto& connection : connections) {
+      latencies.insert(latencies.end(), connection.latencies.begin(), connection.latencies.end());
+      if ((int)connection.latencies.size() < options.requests) {
+        result.failures++;
+      }
+    }
+    std::sort(latencies.begin(), latencies.end());
+    result.requests = (long long)latencies.size();
+    result.p50 = getPercentile(latencies, 0.50) * 1e6;
+    result.p99 = getPercentile(latencies, 0.99) * 1e6;
+  }
+  freeaddrinfo(information);
+  return status;
+}
+
+// Print the results of a load generator run on a single line.
+//
+// @param profile The socket tuning profile used in the run.
+// @param options The parameters of the run.
+// @param result The results of the run.
+void printLoadResult(const SocketProfile& profile, const LoadOptions& options, const LoadResult& result) {
+  auto seconds = result.elapsed > 0.0 ? result.elapsed : 1e-9;
+  printf("%-10s depth %d, connections %d, size %d: %lld requests in %.3f s, %.0f req/s, %.2f MB/s, p50 %.1f us, p99 %.1f us, %d failed\n",
+    profile.name,
+    options.depth,
+    options.connections,
+    options.size,
+    result.requests,
+    result.elapsed,
+    result.requests / seconds,
+    result.requests * (double)options.size / seconds / (1024.0 * 1024.0),
+    result.p50,
+    result.p99,
+    result.failures);
+}
+
+// A capture file mapped into the memory for reading.
+struct CaptureFile {
+  HANDLE      file;
+  HANDLE      mapping;
+  const char* data;
+  long long   size;
+};
+
+// Release a capture file mapped with the mapCaptureFile function.
+//
+// @param capture The capture to be released.
+void unmapCaptureFile(CaptureFile& capture) {
+  if (capture.data != NULL) {
+    UnmapViewOfFile(capture.data);
+  }
+  if (capture.mapping != NULL) {
+    CloseHandle(capture.mapping);
+  }
+  if (capture.file != INVALID_HANDLE_VALUE) {
+    CloseHandle(capture.file);
+  }
+}
+
+// Map a capture file into the memory and check that its header matches the
+// record layout of this build. The records are read in place from the mapping.
+// The file is shared for writing, so that the capture of a running server can
+// be replayed up to the records written so far.
+//
+// @param path The path of the capture file.
+// @param capture The mapped capture.
+// @returns 0 on a success and a non-zero on an error.
+int mapCaptureFile(const char* path, CaptureFile& capture) {
+  capture.mapping = NULL;
+  capture.data = NULL;
+  capture.size = 0;
+  capture.file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (capture.file == INVALID_HANDLE_VALUE) {
+    printf("CreateFile failed: An error code %lu occured while opening %s.\n", GetLastError(), path);
+    return 1;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(capture.file, &size) || size.QuadPart < (LONGLONG)sizeof(CaptureHeader)) {
+    printf("replay failed: The file %s is not a capture.\n", path);
+    unmapCaptureFile(capture);
+    return 1;
+  }
+  capture.mapping = CreateFileMapping(capture.file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (capture.mapping == NULL) {
+    printf("CreateFileMapping failed: An error code %lu occured.\n", GetLastError());
+    unmapCaptureFile(capture);
+    return 1;
+  }
+  capture.data = (const char*)MapViewOfFile(capture.mapping, FILE_MAP_READ, 0, 0, 0);
+  if (capture.data == NULL) {
+    printf("MapViewOfFile failed: An error code %lu occured.\n", GetLastError());
+    unmapCaptureFile(capture);
+    return 1;
+  }
+  capture.size = size.QuadPart;
+
+  auto header = (const CaptureHeader*)capture.data;
+  if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0 || header->version != CAPTURE_VERSION) {
+    printf("replay failed: The file %s is not a version %d capture.\n", path, CAPTURE_VERSION);
+    unmapCaptureFile(capture);
+    return 1;
+  }
+  return 0;
+}
+
+// The mapping from the capture time into the time of the replay.
+struct ReplayClock {
+  double    startTime; // The time when the replay was started in seconds.
+  long long baseTime;  // The capture time of the first record in nanoseconds.
+  int       speed;     // The speedup of the replay over the capture.
+};
+
+// Get the replay time matching the given capture time.
+//
+// @param clock The clock of the replay.
+// @param captureTime The capture time in nanoseconds.
+// @returns The replay time in seconds.
+double getReplayTime(const ReplayClock& clock, long long captureTime) {
+  return clock.startTime + (captureTime - clock.baseTime) / 1e9 / clock.speed;
+}
+
+// Wait until the given time. The coarse part of the wait is slept and the last
+// REPLAY_SPIN seconds are spun, as the sleep is only as precise as the timer.
+//
+// @param time The time to wait for in seconds.
+void waitUntil(double time) {
+  auto remaining = time - getTime();
+  if (remaining > REPLAY_SPIN) {
+    Sleep((DWORD)((remaining - REPLAY_SPIN) * 1000.0));
+  }
+  while (getTime() < time) {
+    Sleep(0);
+  }
+}
+
+// A captured connection replayed in its own thread.
+struct ReplayConnection {
+  addrinfo*                         address;
+  const SocketProfile*              profile;
+  const ReplayClock*                clock;
+  HANDLE                            startEvent;
+  int                               index;
+  long long                         openTime;  // The capture time of the connection open.
+  long long                         closeTime; // The capture time of the connection close.
+  std::vector<const CaptureRecord*> requests;  // The inbound records within the mapping.
+  std::vector<double>               originals; // The captured latency of each request or -1.0.
+  std::vector<double>               latencies; // The replayed latency of each request or -1.0.
+  std::vector<double>               lateness;  // How late each request was sent.
+  bool                              completed;
+};
+
+// Load the captured connections from a mapped capture. Each captured response
+// is paired with the oldest unanswered request of the same id on the same
+// connection, which gives the latency of the request as seen by the server. A
+// truncated record at the end is ignored, as the capture of a running server
+// may end in the middle of a record. The requests longer than REPLAY_MAX_LENGTH
+// are skipped along with their responses, as any client may claim such lengths
+// in its frame headers and the replay would have to allocate them in full.
+//
+// @param capture The mapped capture.
+// @param connections The connections loaded from the capture.
+// @param baseTime The capture time of the first record.
+// @returns The number of the loaded records.
+long long loadReplayConnections(const CaptureFile& capture, std::vector<ReplayConnection>& connections, long long& baseTime) {
+  std::map<u_long, int> indices;
+  std::vector<std::vector<std::pair<const CaptureRecord*, int>>> unanswered;
+  auto records = 0LL;
+  auto skipped = 0LL;
+  auto offset = (long long)sizeof(CaptureHeader);
+  baseTime = 0;
+  while (offset + (long long)sizeof(CaptureRecord) <= capture.size) {
+    auto record = (const CaptureRecord*)(capture.data + offset);
+    auto recordSize = (long long)sizeof(CaptureRecord) + ((record->stored + 7) & ~7);
+    if (offset + recordSize > capture.size || record->direction > CAPTURE_CLOSE || record->stored > record->length) {
+      break;
+    }
+    offset += recordSize;
+    if (records++ == 0 || record->time < baseTime) {
+      baseTime = record->time;
+    }
+
+    // find the connection of the record or start a new one.
+    auto entry = indices.find(record->connection);
+    if (entry == indices.end()) {
+      entry = indices.insert(std::make_pair(record->connection, (int)connections.size())).first;
+      connections.push_back(ReplayConnection());
+      connections.back().openTime = record->time;
+      connections.back().closeTime = record->time;
+      unanswered.push_back(std::vector<std::pair<const CaptureRecord*, int>>());
+    }
+    auto& connection = connections[entry->second];
+    auto& pending = unanswered[entry->second];
+    connection.closeTime = std::max(connection.closeTime, record->time);
+    if (record->direction == CAPTURE_OPEN) {
+      connection.openTime = record->time;
+    } else if (record->direction == CAPTURE_INBOUND && record->length > REPLAY_MAX_LENGTH) {
+      pending.push_back(std::make_pair(record, -1));
+      skipped++;
+    } else if (record->direction == CAPTURE_INBOUND) {
+      pending.push_back(std::make_pair(record, (int)connection.requests.size()));
+      connection.requests.push_back(record);
+      connection.originals.push_back(-1.0);
+    } else if (record->direction == CAPTURE_OUTBOUND) {
+      for (size_t i = 0; i < pending.size(); i++) {
+        auto request = pending[i].first;
+        if (request->id == record->id) {
+          if (pending[i].second >= 0) {
+            connection.originals[pending[i].second] = (record->time - request->time) / 1e9;
+          }
+          pending.erase(pending.begin() + i);
+          break;
+        }
+      }
+    }
+  }
+  if (skipped > 0) {
+    printf("replay: Skipping %lld requests longer than %d bytes.\n", skipped, REPLAY_MAX_LENGTH);
+  }
+  if (offset < capture.size) {
+    printf("replay: Ignoring %lld bytes of a truncated record at the end of the capture.\n", capture.size - offset);
+  }
+  return records;
+}
+
+// Send the captured requests of a connection at their replay times and read
+// the responses concurrently. The requests keep their captured ids and carry
+// the stored part of the payload padded with zeros to the captured length. The
+// socket is made nonblocking and multiplexed with select, where the wait is cut
+// short before the next request is due and the rest of the wait is spun.
+//
+// @param socket A connected client socket.
+// @param connection The connection to be replayed.
+// @returns 0 on a success and a non-zero when the replay was interrupted.
+int replayRequests(SOCKET socket, ReplayConnection& connection) {
+  auto& clock = *connection.clock;
+  auto count = (int)connection.requests.size();
+  std::vector<char> request;
+  std::vector<char> response(WORKER_BUFFER_SIZE);
+  std::vector<double> sendTimes(count);
+  std::vector<int> outstanding;
+  auto next = 0;
+  auto requestOffset = 0LL;
+  char header[sizeof(FrameHeader)];
+  auto headerFilled = 0;
+  long long payloadRemaining = 0;
+  auto progressTime = getTime();
+  auto status = 0;
+
+  u_long nonblocking = 1;
+  ioctlsocket(socket, FIONBIO, &nonblocking);
+  while (next < count || !outstanding.empty()) {
+    // start the next request when it is due and the previous one is sent.
+    auto now = getTime();
+    auto isSending = requestOffset < (long long)request.size();
+    auto dueTime = next < count ? getReplayTime(clock, connection.requests[next]->time) : 0.0;
+    if (!isSending && next < count && now >= dueTime) {
+      auto record = connection.requests[next];
+      auto frameSize = (long long)sizeof(FrameHeader) + record->length;
+      request.assign((size_t)frameSize, 0);
+      writeFrameHeader(request.data(), record->id, record->length);
+      memcpy(request.data() + sizeof(FrameHeader), record + 1, record->stored);
+      connection.lateness.push_back(now - dueTime);
+      sendTimes[next] = now;
+      outstanding.push_back(next++);
+      requestOffset = 0;
+      progressTime = now;
+      isSending = true;
+    }
+    if (!isSending && next == count && now - progressTime > REPLAY_TIMEOUT) {
+      printf("recv failed: No response was received in %.0f s for %d requests.\n", REPLAY_TIMEOUT, (int)outstanding.size());
+      status = 1;
+      break;
+    }
+
+    auto waitTime = REPLAY_TIMEOUT;
+    if (!isSending && next < count) {
+      waitTime = std::max(dueTime - now - REPLAY_SPIN, 0.0);
+    }
+    timeval timeout;
+    timeout.tv_sec = (long)waitTime;
+    timeout.tv_usec = (long)((waitTime - timeout.tv_sec) * 1e6);
+    fd_set readSet;
+    fd_set writeSet;
+    FD_ZERO(&readSet);
+    FD_ZERO(&writeSet);
+    FD_SET(socket, &readSet);
+    if (isSending) {
+      FD_SET(socket, &writeSet);
+    }
+    if (select(0, &readSet, &writeSet, NULL, &timeout) == SOCKET_ERROR) {
+      printf("select failed: An error code %d occured while replaying.\n", WSAGetLastError());
+      status = 1;
+      break;
+    }
+
+    if (FD_ISSET(socket, &writeSet)) {
+      auto length = (int)std::min<long long>((long long)request.size() - requestOffset, 0x7fffffff);
+      auto result = send(socket, request.data() + requestOffset, length, 0);
+      if (result == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK) {
+        printf("send failed: An error code %d occured while replaying.\n", WSAGetLastError());
+        status = 1;
+        break;
+      } else if (result > 0) {
+        requestOffset += result;
+      }
+    }
+
+    if (FD_ISSET(socket, &readSet)) {
+      auto result = recv(socket, response.data(), (int)response.size(), 0);
+      if (result == 0) {
+        status = 1;
+        break;
+      } else if (result == SOCKET_ERROR) {
+        if (WSAGetLastError() == WSAEWOULDBLOCK) {
+          continue;
+        }
+        printf("recv failed: An error code %d occured while replaying.\n", WSAGetLastError());
+        status = 1;
+        break;
+      }
+
+      // walk through the received frames and complete the oldest matching requests.
+      now = getTime();
+      progressTime = now;
+      for (auto offset = 0; offset < result && status == 0;) {
+        if (headerFilled < (int)sizeof(header)) {
+          auto length = std::min((int)sizeof(header) - headerFilled, result - offset);
+          memcpy(header + headerFilled, response.data() + offset, length);
+          headerFilled += length;
+          offset += length;
+          if (headerFilled < (int)sizeof(header)) {
+            continue;
+          }
+          payloadRemaining = readFrameHeader(header).length;
+        }
+        auto length = (int)std::min<long long>(payloadRemaining, result - offset);
+        payloadRemaining -= length;
+        offset += length;
+        if (payloadRemaining == 0) {
+          auto id = readFrameHeader(header).id;
+          auto match = outstanding.begin();
+          while (match != outstanding.end() && connection.requests[*match]->id != id) {
+            match++;
+          }
+          if (match == outstanding.end()) {
+            printf("recv failed: An unexpected response id %lu was received.\n", (unsigned long)id);
+            status = 1;
+            break;
+          }
+          connection.latencies[*match] = now - sendTimes[*match];
+          outstanding.erase(match);
+          headerFilled = 0;
+        }
+      }
+      if (status != 0) {
+        break;
+      }
+    }
+  }
+  nonblocking = 0;
+  ioctlsocket(socket, FIONBIO, &nonblocking);
+  return status;
+}
+
+// Replay a single captured connection. The connection is opened at its replay
+// time, after which its requests are replayed and the connection is held open
+// until its captured close time, so that the concurrency of the capture is kept.
+//
+// @param parameter A pointer to the replay connection.
+// @returns 0 as the exit code of the thread.
+DWORD WINAPI replayConnection(LPVOID parameter) {
+  auto connection = (ReplayConnection*)parameter;
+  auto& profile = *connection->profile;
+  if (profile.pinThreads) {
+    pinThread(connection->index, true);
+  }
+  WaitForSingleObject(connection->startEvent, INFINITE);
+  waitUntil(getReplayTime(*connection->clock, connection->openTime));
+
+  auto socket = createSocket(connection->address);
+  if (socket != INVALID_SOCKET) {
+    tuneUnconnectedSocket(socket, profile, false);
+    if (connectSocket(socket, &connection->address) == 0) {
+      tuneConnectedSocket(socket, profile);
+      if (replayRequests(socket, *connection) == 0) {
+        waitUntil(getReplayTime(*connection->clock, connection->closeTime));
+        connection->completed = true;
+      }
+      shutdownSocket(socket, SD_BOTH);
+    }
+    closeSocket(socket);
+  }
+  return 0;
+}
+
+// Print the results of a replay. The captured service time is the time from the
+// receipt of a request to the send of its response as seen by the server,
+// whereas the replayed latency is the full round trip seen by the client. The
+// per request difference of the two is thus the round trip minus the captured
+// service time, which includes the network round trip. For a like with like
+// comparison, the server of the replay can capture its own service times.
+//
+// @param connections The replayed connections.
+// @param clock The clock of the replay.
+// @param records The number of the records in the capture.
+// @param elapsed The duration of the replay in seconds.
+void printReplayResult(const std::vector<ReplayConnection>& connections, const ReplayClock& clock, long long records, double elapsed) {
+  std::vector<double> originals;
+  std::vector<double> latencies;
+  std::vector<double> differences;
+  std::vector<double> lateness;
+  auto requests = 0LL;
+  auto unanswered = 0LL;
+  auto failures = 0;
+  auto endTime = clock.baseTime;
+  for (const auto& connection : connections) {
+    endTime = std::max(endTime, connection.closeTime);
+    if (!connection.completed) {
+      failures++;
+    }
+    for (size_t i = 0; i < connection.requests.size(); i++) {
+      requests++;
+      if (connection.originals[i] >= 0.0) {
+        originals.push_back(connection.originals[i]);
+      }
+      if (connection.latencies[i] < 0.0) {
+        unanswered++;
+      } else {
+        latencies.push_back(connection.latencies[i]);
+        if (connection.originals[i] >= 0.0) {
+          differences.push_back(connection.latencies[i] - connection.originals[i]);
+        }
+      }
+    }
+    lateness.insert(lateness.end(), connection.lateness.begin(), connection.lateness.end());
+  }
+  std::sort(originals.begin(), originals.end());
+  std::sort(latencies.begin(), latencies.end());
+  std::sort(differences.begin(), differences.end());
+  std::sort(lateness.begin(), lateness.end());
+
+  printf("capture: %lld records of %d connections with %lld requests over %.3f s.\n",
+    records,
+    (int)connections.size(),
+    requests,
+    (endTime - clock.baseTime) / 1e9);
+  printf("replay: %lld requests at %dx speed in %.3f s, %lld unanswered, %d connections failed.\n",
+    requests,
+    clock.speed,
+    elapsed,
+    unanswered,
+    failures);
+  printf("latency: captured service time p50 %.1f us, p99 %.1f us, replayed round trip p50 %.1f us, p99 %.1f us, round trip minus service time p50 %+.1f us, p99 %+.1f us.\n",
+    getPercentile(originals, 0.50) * 1e6,
+    getPercentile(originals, 0.99) * 1e6,
+    getPercentile(latencies, 0.50) * 1e6,
+    getPercentile(latencies, 0.99) * 1e6,
+    getPercentile(differences, 0.50) * 1e6,
+    getPercentile(differences, 0.99) * 1e6);
+  printf("timing: requests sent late by p50 %.1f us, p99 %.1f us.\n",
+    getPercentile(lateness, 0.50) * 1e6,
+    getPercentile(lateness, 0.99) * 1e6);
+}
+
+// Replay a capture against the target host. Each captured connection is run
+// in its own thread, which opens the connection and sends the requests at the
+// captured times scaled by the speed, so that both the inter-arrival times and
+// the concurrency of the capture are preserved. The system timer resolution is
+// raised for the duration of the replay to make the sleeps more precise.
+//
+// @param host The target host to connect to.
+// @param profile The socket tuning profile for the client sockets.
+// @param path The path of the capture file.
+// @param speed The speedup of the replay over the capture.
+// @returns 0 on a success and a non-zero on an error.
+int runReplay(const char* host, const SocketProfile& profile, const char* path, int speed) {
+  CaptureFile capture;
+  if (mapCaptureFile(path, capture) != 0) {
+    return 1;
+  }
+  ReplayClock clock;
+  clock.speed = speed;
+  std::vector<ReplayConnection> connections;
+  auto records = loadReplayConnections(capture, connections, clock.baseTime);
+
+  // create an address descriptor for a TCP client socket.
+  addrinfo hints;
+  ZeroMemory(&hints, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+
+  // resolve address details and start the replay threads.
+  addrinfo* information = NULL;
+  auto status = resolveAddress(host, hints, &information);
+  if (status == 0) {
+    auto verbose = gVerbose;
+    gVerbose = false;
+    timeBeginPeriod(1);
+    auto startEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    std::vector<HANDLE> threads;
+    for (size_t i = 0; i < connections.size(); i++) {
+      auto& connection = connections[i];
+      connection.address = information;
+      connection.profile = &profile;
+      connection.clock = &clock;
+      connection.startEvent = startEvent;
+      connection.index = (int)i;
+      connection.latencies.assign(connection.requests.size(), -1.0);
+      connection.completed = false;
+      auto thread = startThread(replayConnection, &connection);
+      if (thread != NULL) {
+        threads.push_back(thread);
+      }
+    }
+
+    // start the replay and wait for all the connections to complete.
+    clock.startTime = getTime();
+    SetEvent(startEvent);
+    for (auto thread : threads) {
+      WaitForSingleObject(thread, INFINITE);
+      CloseHandle(thread);
+    }
+    auto elapsed = getTime() - clock.startTime;
+    CloseHandle(startEvent);
+    timeEndPeriod(1);
+    gVerbose = verbose;
+    printReplayResult(connections, clock, records, elapsed);
+  }
+  freeaddrinfo(information);
+  unmapCaptureFile(capture);
+  return status;
+}
+
+// The options given from the command line.
+struct Options {
+  const char*          host;
+  const SocketProfile* profiles[sizeof(gProfiles) / sizeof(gProfiles[0])];
+  int                  profileCount;
+  bool                 loopback;
+  LoadOptions          load;
+  int                  depths[MAX_DEPTHS];
+  int                  depthCount;
+  ServerOptions        server;
+  const char*          benchPath;
+  const char*          baselinePath;
+  int                  tolerance;
+  int                  p99Tolerance;
+  bool                 updateBaseline;
+  const char*          replayPath;
+  int                  speed;
+};
+
+void startTcpClient(const char* host, const Options& options) {
+  if (options.load.requests > 0) {
+    for (auto i = 0; i < options.profileCount; i++) {
+      for (auto j = 0; j < options.depthCount; j++) {
+        auto load = options.load;
+        load.depth = options.depths[j];
+        LoadResult result;
+        if (runLoad(host, *options.profiles[i], load, result) == 0) {
+          printLoadResult(*options.profiles[i], load, result);
+        }
+      }
+    }
+    return;
+  }
+
+  // create an address descriptor for a TCP client socket.
+  addrinfo hints;
+  ZeroMemory(&hints, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+
+  // resolve address details and open a new socket.
+  auto& profile = *options.profiles[0];
+  addrinfo* information = NULL;
+  if (resolveAddress(host, hints, &information) == 0) {
+    auto socket = createSocket(information);
+    if (socket != INVALID_SOCKET) {
+      tuneUnconnectedSocket(socket, profile, false);
+      if (connectSocket(socket, &information) == 0) {
+        tuneConnectedSocket(socket, profile);
+        send(socket, "A message from the client!");
+        receive(socket);
+        shutdownSocket(socket, SD_BOTH);
+      }
+      closeSocket(socket);
+    }
+  }
+  freeaddrinfo(information);
+}
+
+// Run the load generator over loopback for each of the selected profiles and
+// pipeline depths. The server is started in-process for each profile with the
+// same profile as the client, so that the profiles can be compared against
+// each other (A/B).
+//
+// @param options The options given from the command line.
+void startLoopbackTest(const Options& options) {
+  for (auto i = 0; i < options.profileCount; i++) {
+    auto& profile = *options.profiles[i];
+    Server server;
+    if (startServer(server, profile, options.server) == 0) {
+      for (auto j = 0; j < options.depthCount; j++) {
+        auto load = options.load;
+        load.depth = options.depths[j];
+        LoadResult result;
+        if (runLoad("127.0.0.1", profile, load, result) == 0) {
+          printLoadResult(profile, load, result);
+        }
+      }
+      stopServer(server);
+    }
+  }
+}
+
+// Replay the capture given from the command line against the target host, or
+// against an in-process server with the same profile when run over loopback.
+//
+// @param options The options given from the command line.
+// @returns 0 on a success and a non-zero on an error.
+int startReplay(const Options& options) {
+  auto& profile = *options.profiles[0];
+  if (!options.loopback) {
+    return runReplay(options.host, profile, options.replayPath, options.speed);
+  }
+  Server server;
+  if (startServer(server, profile, options.server) != 0) {
+    return 1;
+  }
+  auto result = runReplay("127.0.0.1", profile, options.replayPath, options.speed);
+  stopServer(server);
+  return result;
+}
+
+// A single cell of the benchmark matrix along with its results.
+struct BenchResult {
+  char   mode[8];
+  int    size;
+  int    connections;
+  int    requests;
+  int    failures;
+  double throughput; // The completed requests per second.
+  double p50;        // The median request latency in microseconds.
+  double p99;        // The 99th percentile request latency in microseconds.
+};
+
+// Write the benchmark results into a JSON file. Each result is written on its
+// own line, so that the file can be read back without a full JSON parser.
+//
+// @param path The path of the file to be written.
+// @param profile The socket tuning profile used in the benchmark.
+// @param results The benchmark results.
+// @returns 0 on a success and a non-zero on an error.
+int writeBenchResults(const char* path, const SocketProfile& profile, const std::vector<BenchResult>& results) {
+  auto file = fopen(path, "w");
+  if (file == NULL) {
+    printf("fopen failed: The file %s cannot be opened for writing.\n", path);
+    return 1;
+  }
+  fprintf(file, "{\n  \"profile\": \"%s\",\n  \"results\": [\n", profile.name);
+  for (size_t i = 0; i < results.size(); i++) {
+    const auto& result = results[i];
+    fprintf(file, "    {\"mode\": \"%s\", \"size\": %d, \"connections\": %d, \"requests\": %d, \"failures\": %d, \"throughput\": %.1f, \"p50\": %.1f, \"p99\": %.1f}%s\n",
+      result.mode,
+      result.size,
+      result.connections,
+      result.requests,
+      result.failures,
+      result.throughput,
+      result.p50,
+      result.p99,
+      i + 1 < results.size() ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  fclose(file);
+  return 0;
+}
+
+// Read the benchmark results from a JSON file written by writeBenchResults.
+//
+// @param path The path of the file to be read.
+// @param results The results read from the file.
+// @returns 0 on a success and a non-zero if the file cannot be opened.
+int readBenchResults(const char* path, std::vector<BenchResult>& results) {
+  auto file = fopen(path, "r");
+  if (file == NULL) {
+    return 1;
+  }
+  char line[512];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    BenchResult result;
+    auto fields = sscanf(line, " {\"mode\": \"%7[^\"]\", \"size\": %d, \"connections\": %d, \"requests\": %d, \"failures\": %d, \"throughput\": %lf, \"p50\": %lf, \"p99\": %lf",
+      result.mode,
+      &result.size,
+      &result.connections,
+      &result.requests,
+      &result.failures,
+      &result.throughput,
+      &result.p50,
+      &result.p99);
+    if (fields == 8) {
+      results.push_back(result);
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+// Compare the benchmark results against the baseline. A cell is regressed if
+// its throughput drops more than the tolerance, its p99 latency rises more than
+// the p99 tolerance, any of its connections failed, or if a cell of the
+// baseline is missing from the results. The p99 has its own tolerance, as the
+// tail latency over loopback varies much more between runs than the throughput.
+// Cells missing from the baseline are only reported as new cells.
+//
+// @param results The benchmark results.
+// @param baseline The baseline results.
+// @param tolerance The allowed change of the throughput in percents.
+// @param p99Tolerance The allowed change of the p99 latency in percents.
+// @returns The number of regressed cells.
+int compareBenchResults(const std::vector<BenchResult>& results, const std::vector<BenchResult>& baseline, int tolerance, int p99Tolerance) {
+  auto regressions = 0;
+  for (const auto& result : results) {
+    const BenchResult* base = NULL;
+    for (const auto& candidate : baseline) {
+      if (strcmp(candidate.mode, result.mode) == 0 && candidate.size == result.size && candidate.connections == result.connections) {
+        base = &candidate;
+        break;
+      }
+    }
+
+    if (result.failures > 0) {
+      printf("regression: %s size %d connections %d had %d failed connections.\n", result.mode, result.size, result.connections, result.failures);
+      regressions++;
+    } else if (base == NULL) {
+      printf("new: %s size %d connections %d has no baseline.\n", result.mode, result.size, result.connections);
+    } else if (result.throughput < base->throughput * (100 - tolerance) / 100.0) {
+      printf("regression: %s size %d connections %d throughput %.0f req/s, baseline %.0f req/s.\n", result.mode, result.size, result.connections, result.throughput, base->throughput);
+      regressions++;
+    } else if (result.p99 > base->p99 * (100 + p99Tolerance) / 100.0) {
+      printf("regression: %s size %d connections %d p99 %.1f us, baseline %.1f us.\n", result.mode, result.size, result.connections, result.p99, base->p99);
+      regressions++;
+    }
+  }
+  for (const auto& base : baseline) {
+    auto isFound = false;
+    for (const auto& result : results) {
+      if (strcmp(base.mode, result.mode) == 0 && base.size == result.size && base.connections == result.connections) {
+        isFound = true;
+        break;
+      }
+    }
+    if (!isFound) {
+      printf("regression: %s size %d connections %d is missing from the results.\n", base.mode, base.size, base.connections);
+      regressions++;
+    }
+  }
+  return regressions;
+}
+
+// Run a single cell of the benchmark matrix. The cell is run once to warm up
+// the server and the caches, after which it is run BENCH_REPETITIONS times and
+// the median of each measure is taken, so that a single noisy run does not
+// decide the result. A failed connection in any of the runs fails the cell.
+//
+// @param profile The socket tuning profile used in the benchmark.
+// @param load The parameters of the cell.
+// @param result The results of the cell.
+// @returns 0 on a success and a non-zero if a run could not be started.
+int runBenchCell(const SocketProfile& profile, const LoadOptions& load, BenchResult& result) {
+  LoadResult loadResult;
+  if (runLoad("127.0.0.1", profile, load, loadResult) != 0) {
+    return 1;
+  }
+  result.failures = loadResult.failures;
+
+  std::vector<double> throughputs;
+  std::vector<double> p50s;
+  std::vector<double> p99s;
+  for (auto i = 0; i < BENCH_REPETITIONS; i++) {
+    if (runLoad("127.0.0.1", profile, load, loadResult) != 0) {
+      return 1;
+    }
+    printLoadResult(profile, load, loadResult);
+    result.failures = std::max(result.failures, loadResult.failures);
+    throughputs.push_back(loadResult.requests / std::max(loadResult.elapsed, 1e-9));
+    p50s.push_back(loadResult.p50);
+    p99s.push_back(loadResult.p99);
+  }
+  std::sort(throughputs.begin(), throughputs.end());
+  std::sort(p50s.begin(), p50s.end());
+  std::sort(p99s.begin(), p99s.end());
+  result.throughput = throughputs[BENCH_REPETITIONS / 2];
+  result.p50 = p50s[BENCH_REPETITIONS / 2];
+  result.p99 = p99s[BENCH_REPETITIONS / 2];
+  return 0;
+}
+
+// Run the benchmark matrix over loopback against an in-process server. Each
+// payload size and connection count is run with both the request-response
+// and the streaming load, where the streaming load keeps STREAM_WINDOW requests
+// in flight per connection. The number of requests is scaled down for the large
+// cells, but each cell takes at least BENCH_SAMPLES latency samples for a stable
+// p99, and each streaming connection sends at least STREAM_WINDOW requests so
+// that its window gets filled. Cells holding more than BENCH_MEMORY payload bytes
+// in flight over all the connections and their windows are skipped.
+// The server resets the connections closed by the clients, so that the runs do
+// not exhaust the ephemeral ports with connections left in TIME_WAIT. The
+// results are written as JSON and compared with the baseline, which must exist
+// unless it is being updated.
+//
+// @param options The options given from the command line.
+// @returns 0 when there are no regressions and a non-zero otherwise.
+int runBenchmark(const Options& options) {
+  static const int sizes[] = { 16, 256, 4096, 65536, 1 << 20 };
+  static const int connectionCounts[] = { 1, 10, 100, 1000, 10000 };
+  auto& profile = *options.profiles[0];
+
+  std::vector<BenchResult> baseline;
+  if (options.baselinePath != NULL && !options.updateBaseline) {
+    if (readBenchResults(options.baselinePath, baseline) != 0 || baseline.empty()) {
+      printf("benchmark failed: The baseline %s is missing, store one with --update-baseline.\n", options.baselinePath);
+      return 1;
+    }
+  }
+
+  auto serverOptions = options.server;
+  serverOptions.resetOnClose = true;
+  Server server;
+  if (startServer(server, profile, serverOptions) != 0) {
+    return 1;
+  }
+  auto verbose = gVerbose;
+  gVerbose = false;
+  std::vector<BenchResult> results;
+  for (auto depth : { 1, STREAM_WINDOW }) {
+    for (auto size : sizes) {
+      for (auto connections : connectionCounts) {
+        if ((long long)connections * size * depth > BENCH_MEMORY) {
+          continue;
+        }
+        LoadOptions load;
+        load.connections = connections;
+        load.requests = std::max((BENCH_SAMPLES + connections - 1) / connections, std::min(BENCH_REQUESTS, BENCH_BYTES / size) / connections);
+        load.requests = std::max(load.requests, depth);
+        load.size = size;
+        load.depth = depth;
+
+        BenchResult result;
+        strcpy(result.mode, depth > 1 ? "stream" : "rr");
+        result.size = size;
+        result.connections = connections;
+        result.requests = load.requests;
+        if (runBenchCell(profile, load, result) == 0) {
+          results.push_back(result);
+        }
+      }
+    }
+  }
+  gVerbose = verbose;
+  stopServer(server);
+
+  if (writeBenchResults(options.benchPath, profile, results) != 0) {
+    return 1;
+  }
+  printf("benchmark results written to %s.\n", options.benchPath);
+  if (options.baselinePath == NULL) {
+    return 0;
+  }
+
+  if (options.updateBaseline) {
+    printf("storing the results as the baseline %s.\n", options.baselinePath);
+    return writeBenchResults(options.baselinePath, profile, results);
+  }
+  auto regressions = compareBenchResults(results, baseline, options.tolerance, options.p99Tolerance);
+  if (regressions > 0) {
+    printf("benchmark failed: %d regressions beyond the %d%% throughput and %d%% p99 tolerances.\n", regressions, options.tolerance, options.p99Tolerance);
+    return 1;
+  }
+  printf("benchmark passed: no regressions beyond the %d%% throughput and %d%% p99 tolerances.\n", options.tolerance, options.p99Tolerance);
+  return 0;
+}
+
+// Get the value of a command line option given in a form --name=value.
+//
+// @param argument The command line argument.
+// @param name The name of the option including the leading dashes.
+// @returns A pointer to the value or NULL if the argument is not the option.
+const char* getOptionValue(const char* argument, const char* name) {
+  auto length = strlen(name);
+  if (strncmp(argument, name, length) == 0 && argument[length] == '=') {
+    return argument + length + 1;
+  }
+  return NULL;
+}
+
+// Parse a positive integer value of a command line option.
+//
+// @param value The value of the option.
+// @param minimum The smallest allowed value.
+// @param result The parsed value.
+// @returns 0 on a success and a non-zero on an invalid value.
+int parseInteger(const char* value, int minimum, int& result) {
+  char* end = NULL;
+  auto parsed = strtol(value, &end, 10);
+  if (end == value || *end != '\0' || parsed < minimum || parsed > 0x7fffffff) {
+    printf("invalid value: %s\n", value);
+    return 1;
+  }
+  result = (int)parsed;
+  return 0;
+}
+
+// Parse a comma separated list of socket tuning profile names.
+//
+// @param value The value of the option.
+// @param options The options where to store the profiles.
+// @returns 0 on a success and a non-zero on an unknown profile.
+int parseProfiles(const char* value, Options& options) {
+  options.profileCount = 0;
+  while (*value != '\0') {
+    auto length = strcspn(value, ",");
+    auto profile = findProfile(value, length);
+    if (profile == NULL) {
+      printf("unknown profile: %.*s\n", (int)length, value);
+      return 1;
+    }
+    if (options.profileCount < (int)(sizeof(options.profiles) / sizeof(options.profiles[0]))) {
+      options.profiles[options.profileCount++] = profile;
+    }
+    value += length + (value[length] == ',' ? 1 : 0);
+  }
+  return options.profileCount > 0 ? 0 : 1;
+}
+
+// Parse a comma separated list of pipeline depths.
+//
+// @param value The value of the option.
+// @param options The options where to store the depths.
+// @returns 0 on a success and a non-zero on an invalid depth.
+int parseDepths(const char* value, Options& options) {
+  options.depthCount = 0;
+  while (*value != '\0') {
+    char* end = NULL;
+    auto depth = strtol(value, &end, 10);
+    if (end == value || (*end != ',' && *end != '\0') || depth < 1 || depth > (1 << PENDING_SLOT_BITS)) {
+      printf("invalid depth: %s\n", value);
+      return 1;
+    }
+    if (options.depthCount < MAX_DEPTHS) {
+      options.depths[options.depthCount++] = (int)depth;
+    }
+    value = *end == ',' ? end + 1 : end;
+  }
+  return options.depthCount > 0 ? 0 : 1;
+}
+
+// Parse the command line arguments. Options are given in a form --name=value
+// and the first argument that is not an option is used as the target host.
+//
+// @param argc The number of command line arguments.
+// @param argv The command line arguments.
+// @param options The options to be filled from the arguments.
+// @returns 0 on a success and a non-zero on an invalid argument.
+int parseArguments(int argc, char* argv[], Options& options) {
+  options.host = NULL;
+  options.profiles[0] = &gProfiles[0];
+  options.profileCount = 1;
+  options.loopback = false;
+  options.load.connections = 1;
+  options.load.requests = 0;
+  options.load.size = 64;
+  options.load.depth = 1;
+  options.depths[0] = 1;
+  options.depthCount = 1;
+  options.server.admission.maxConnections = 0;
+  options.server.admission.rate = 0;
+  options.server.admission.burst = 0;
+  options.server.admission.acceptBatch = ACCEPT_BATCH;
+  options.server.reorder = false;
+  options.server.resetOnClose = false;
+  options.server.capturePath = NULL;
+  options.server.capturePayload = CAPTURE_PAYLOAD;
+  options.benchPath = NULL;
+  options.baselinePath = NULL;
+  options.tolerance = 10;
+  options.p99Tolerance = 25;
+  options.updateBaseline = false;
+  options.replayPath = NULL;
+  options.speed = 1;
+
+  auto result = 0;
+  for (auto i = 1; i < argc && result == 0; i++) {
+    const char* argument = argv[i];
+    const char* value = NULL;
+    if ((value = getOptionValue(argument, "--profile")) != NULL) {
+      result = parseProfiles(value, options);
+    } else if ((value = getOptionValue(argument, "--connections")) != NULL) {
+      result = parseInteger(value, 1, options.load.connections);
+    } else if ((value = getOptionValue(argument, "--requests")) != NULL) {
+      result = parseInteger(value, 0, options.load.requests);
+    } else if ((value = getOptionValue(argument, "--size")) != NULL) {
+      result = parseInteger(value, 1, options.load.size);
+    } else if ((value = getOptionValue(argument, "--mode")) != NULL) {
+      if (strcmp(value, "rr") == 0 || strcmp(value, "stream") == 0) {
+        options.depths[0] = strcmp(value, "stream") == 0 ? STREAM_WINDOW : 1;
+        options.depthCount = 1;
+      } else {
+        printf("unknown mode: %s\n", value);
+        result = 1;
+      }
+    } else if ((value = getOptionValue(argument, "--depth")) != NULL) {
+      result = parseDepths(value, options);
+    } else if (strcmp(argument, "--reorder") == 0) {
+      options.server.reorder = true;
+    } else if ((value = getOptionValue(argument, "--max-connections")) != NULL) {
+      result = parseInteger(value, 0, options.server.admission.maxConnections);
+    } else if ((value = getOptionValue(argument, "--rate")) != NULL) {
+      result = parseInteger(value, 0, options.server.admission.rate);
+    } else if ((value = getOptionValue(argument, "--burst")) != NULL) {
+      result = parseInteger(value, 1, options.server.admission.burst);
+    } else if ((value = getOptionValue(argument, "--accept-batch")) != NULL) {
+      result = parseInteger(value, 1, options.server.admission.acceptBatch);
+    } else if ((value = getOptionValue(argument, "--capture")) != NULL) {
+      options.server.capturePath = value;
+    } else if ((value = getOptionValue(argument, "--capture-payload")) != NULL) {
+      result = parseInteger(value, 0, options.server.capturePayload);
+      if (result == 0 && options.server.capturePayload > 0xffff) {
+        printf("invalid value: %s\n", value);
+        result = 1;
+      }
+    } else if ((value = getOptionValue(argument, "--replay")) != NULL) {
+      options.replayPath = value;
+    } else if ((value = getOptionValue(argument, "--speed")) != NULL) {
+      result = parseInteger(value, 1, options.speed);
+    } else if ((value = getOptionValue(argument, "--bench")) != NULL) {
+      options.benchPath = value;
+    } else if ((value = getOptionValue(argument, "--baseline")) != NULL) {
+      options.baselinePath = value;
+    } else if ((value = getOptionValue(argument, "--tolerance")) != NULL) {
+      result = parseInteger(value, 0, options.tolerance);
+    } else if ((value = getOptionValue(argument, "--p99-tolerance")) != NULL) {
+      result = parseInteger(value, 0, options.p99Tolerance);
+    } else if (strcmp(argument, "--update-baseline") == 0) {
+      options.updateBaseline = true;
+    } else if (strcmp(argument, "--loopback") == 0) {
+      options.loopback = true;
+    } else if (strcmp(argument, "--quiet") == 0) {
+      gVerbose = false;
+    } else if (strncmp(argument, "--", 2) == 0) {
+      printf("unknown option: %s\n", argument);
+      result = 1;
+    } else {
+      options.host = argument;
+    }
+  }
+  if (options.loopback && options.load.requests == 0) {
+    options.load.requests = 1000;
+  }
+  if (options.server.admission.burst == 0) {
+    options.server.admission.burst = std::max(options.server.admission.rate, 1);
+  }
+  if (result == 0 && options.replayPath != NULL && options.host == NULL && !options.loopback) {
+    printf("missing target: The replay needs a target host or --loopback.\n");
+    result = 1;
+  }
+  return result;
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (parseArguments(argc, argv, options) != 0) {
+    printf("usage: test.exe [--profile=<name>[,<name>...]] [--connections=<n>] [--requests=<n>] [--size=<n>] [--mode=<rr|stream>] [--depth=<n>[,<n>...]] [--loopback] [--quiet] [target-ip]\n");
+    printf("       test.exe [--max-connections=<n>] [--rate=<n>] [--burst=<n>] [--accept-batch=<n>] [--reorder] [--capture=<file>] [--capture-payload=<n>] (server and loopback)\n");
+    printf("       test.exe --bench=<results.json> [--baseline=<baseline.json>] [--tolerance=<percent>] [--p99-tolerance=<percent>] [--update-baseline] [--profile=<name>]\n");
+    printf("       test.exe --replay=<file> [--speed=<n>] [--profile=<name>] [--loopback | target-ip]\n");
+    return 1;
+  }
+
+  auto executionStatus = initWSA();
+  if (executionStatus == 0) {
+    auto runStatus = 0;
+    if (options.benchPath != NULL) {
+      runStatus = runBenchmark(options);
+    } else if (options.replayPath != NULL) {
+      runStatus = startReplay(options);
+    } else if (options.loopback) {
+      startLoopbackTest(options);
+    } else if (options.host != NULL) {
+      startTcpClient(options.host, options);
+    } else {
+      startTcpServer(*options.profiles[0], options.server);
+    }
+    executionStatus = cleanupWSA();
+    if (executionStatus == 0) {
+      executionStatus = runStatus;
     }
-    executionStatus = cleanupWSA();
   }
   return executionStatus;
 }